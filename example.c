@@ -1,97 +1,100 @@
 // SPDX-License-Identifier: LGPL-2.0
 /*
  * Example to demonstrate the transmission of DMA packets to a router.
- * This sample code transmits a read control packet to read 1 dword from the host
- * router of domain 0.
+ * This sample code opens the host thunderbolt controllers of all the domains, each
+ * from its own thread, transmits a read control packet to read 1 dword from the
+ * host router of every domain, and prints the dword received in the response and
+ * the f/w ready latencies of all the bring-ups.
  *
  * To build and run:
- * gcc -g -Wall -W example.c tbtutils.c passthrough.c pciutils.c utils.c -o test
+ * gcc -g -Wall -W example.c tbtutils.c passthrough.c pciutils.c utils.c -o test -lpthread
  * sudo ./test
  *
  * Copyright (C) 2023 Rajat Khandelwal <rajat.khandelwal@intel.com>
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #include "tbtutils.h"
 
-int main(void)
-{
-	/* Fetch the PCI ID for the host thunderbolt controller for domain 0 */
-	char *pci_id = trim_host_pci_id(0);
-	struct vfio_hlvl_params *params;
-	struct pci_vdid *dev_list;
-	u64 num = 0;
+struct domain_work {
+	pthread_t thread;
+	bool started;
+	u8 domain;
 	int ret;
+};
 
-	if (!pci_id) {
-		ret = 1;
-		goto pci_out;
+/* Drives the host thunderbolt controller of one domain, independent of the others */
+static void* run_domain(void *arg)
+{
+	struct domain_work *work = arg;
+	struct tbt_ctlr *ctlr;
+	u32 val;
+
+	/* Bind VFIO, power on the h/w and set up the TX and RX rings */
+	ctlr = tbt_ctlr_open(work->domain);
+	if (!ctlr) {
+		work->ret = 1;
+		return NULL;
 	}
 
-	/*
-	 * Fetch the count of the no. of modules in the same IOMMU group as the
-	 * PCI device.
-	 */
-	num = total_grp_modules(pci_id);
+	/* Wait for the completions in the interrupt mode if possible, else poll them */
+	if (enable_ring_irqs(ctlr))
+		printf("domain %u: interrupts not available, polling for completions\n",
+		       work->domain);
 
-	/* Check the presence of VFIO module in the system */
-	if (!check_vfio_module()) {
-		fprintf(stderr, "VFIO not found\n");
-		ret = 1;
+	/* Request 1 dword from router config. space at offset 0x0 */
+	work->ret = request_router_cfg(ctlr, 0, 0, 1, &val);
+	if (!work->ret)
+		printf("domain %u: router config. space dword 0: 0x%08x\n", work->domain,
+		       val);
 
-		goto check_vfio_out;
-	}
+	tbt_ctlr_close(ctlr);
 
-	/* Bind all the modules present in the same IOMMU group as the PCI device */
-	dev_list = bind_grp_modules(pci_id);
+	return NULL;
+}
 
-	/* Initialize the VFIO for the PCI device */
-	params = vfio_dev_init(pci_id);
-	if (!params) {
-		ret = 1;
-		goto vfio_init_out;
+int main(void)
+{
+	u8 domains = total_domains();
+	struct domain_work *works;
+	int ret = 0;
+	u8 i = 0;
+
+	if (!domains) {
+		fprintf(stderr, "no thunderbolt domains found\n");
+		exit(1);
 	}
 
-	/* Fetch the BAR and PCI config. space regions for the PCI device */
-	get_dev_bar_regions(params);
-	get_dev_pci_cfg_region(params);
-
-	/* Reset the host interface registers for the thunderbolt host controller */
-	reset_host_interface(params);
+	/* Check the presence of VFIO module in the system */
+	if (!check_vfio_module()) {
+		fprintf(stderr, "VFIO not found\n");
+		exit(1);
+	}
 
-	/* Initialize the thunderbolt hardware before executing anything */
-	ret = tbt_hw_init(pci_id);
-	if (ret)
-		goto tbt_init_out;
+	works = calloc(domains, sizeof(struct domain_work));
 
-	/* Allocate the TX and RX descriptors for the host thunderbolt controller */
-	allocate_tx_desc(params);
-	allocate_rx_desc(params);
+	for (; i < domains; i++) {
+		works[i].domain = i;
 
-	/* Initialize the TX and RX host interface registers for the thunderbolt controller */
-	init_host_tx(params);
-	init_host_rx(params);
+		works[i].started = !pthread_create(&works[i].thread, NULL, run_domain,
+						   &works[i]);
+		if (!works[i].started)
+			run_domain(&works[i]);
+	}
 
-	/* Request 1 dword from router config. space at offset 0x0 */
-	ret = request_router_cfg(pci_id, params, 0, 0, 1);
+	for (i = 0; i < domains; i++) {
+		if (works[i].started)
+			pthread_join(works[i].thread, NULL);
 
-	free_tx_rx_desc(params);
+		ret |= works[i].ret;
+	}
 
-tbt_init_out:
-	free(params->dev_info);
-	free_list(params->bar_regions);
-	free(params->pci_cfg_region);
+	free(works);
 
-	close(params->container);
-	close(params->group);
+	print_fw_ready_stats();
 
-	free(params);
-vfio_init_out:
-	unbind_grp_modules(dev_list, num);
-check_vfio_out:
-	free(pci_id);
-pci_out:
-	exit(ret); /* Terminate all the threads, if exist */
+	exit(!!ret); /* Terminate all the threads, if exist */
 }
@@ -21,6 +21,9 @@
 #define VS_DMA_DELAY_MASK		BITMASK(31, 24)
 #define VS_DMA_DELAY_SHIFT		24
 
+/* DMA delay counter value for the force power, as in the Linux ICL NHI ops */
+#define VS_DMA_DELAY			0x22
+
 /* ICM registers (used for thunderbolt initialization) */
 #define ICM_FW_STS			0x39944
 #define ICM_NVM_AUTH_DONE		BIT(31)
@@ -36,8 +39,20 @@
 #define RESET				BIT(0)
 
 #define HOST_CTRL			0x39864
+#define INT_AUTO_CLR			BIT(2)
 #define DISABLE_ISR_AUTO_CLR		BIT(17)
 
+/*
+ * Ring interrupts. Every ring has a bit in the enable registers and a 4-bit
+ * MSI-X vector in the vector allocation registers, TX rings first, followed by the RX
+ * rings (i.e., RX ring 'n' is at index 'n + TOTAL_PATHS').
+ */
+#define RING_INT_EN			0x38200
+#define RING_INT_VEC_ALLOC		0x38c40
+#define RING_INT_VEC_BITS		4
+#define RING_INT_VEC_PER_REG		(32 / RING_INT_VEC_BITS)
+#define RING_INT_VEC_MASK		BITMASK(3, 0)
+
 #define HOST_CL1_ENABLE			0x39880
 
 #define HOST_CL2_ENABLE			0x39884
@@ -49,6 +64,7 @@
 #define TX_PROD_CONS_INDEX		0x8
 #define TX_PROD_INDEX			BITMASK(31, 16)
 #define TX_PROD_INDEX_SHIFT		16
+#define TX_CONS_INDEX			BITMASK(15, 0)
 
 #define TX_RING_SIZE			0xc
 
@@ -29,6 +29,21 @@
 static char *tbt_debugfs_path = "/sys/kernel/debug/thunderbolt/";
 
 static struct router_config *routers_config = NULL;
+static u64 total_routers_config = 0;
+
+/* Open-addressed hash index from the router name to its config */
+static struct router_config **routers_index = NULL;
+static u64 routers_index_size = 0;
+
+/* Start of a capability in the register dump, used while parsing the 'regs' file */
+struct cap_start {
+	u8 cap_id;
+	u8 vcap_id;
+	u64 start;
+};
+
+/* Directory fd of 'tbt_sysfs_path', opened on the first attribute read */
+static int tbt_sysfs_fd = -1;
 
 static char options[] = {'D', 'd', 's', 'r', 't', 'v', 'V', 'h', '\0'};
 
@@ -56,275 +71,314 @@ char *help_msg =
 
 /*
  * Returns the max. adapter num plus '1', as present in the debugfs of a
- * router.
+ * router, and marks the adapters present in 'present'.
  */
-static u8 get_total_adps_debugfs(const char *router)
+static u8 get_adps_debugfs(const char *router, bool present[MAX_ADAPTERS])
 {
-	struct list_item *item;
+	struct list_item *item, *head;
 	char path[MAX_LEN];
 	char *root_cmd;
-	u8 port = 63;
 	u8 ret = 0;
+	u32 port;
+
+	memset(present, 0, MAX_ADAPTERS * sizeof(bool));
 
 	snprintf(path, sizeof(path), "ls %s%s | grep 'port'", tbt_debugfs_path,
 		 router);
 	root_cmd = switch_cmd_to_root(path);
 
 	item = do_bash_cmd_list(root_cmd);
+	head = item;
+
+	for (; item; item = item->next) {
+		char *name = (char*)item->val;
+
+		if (strncmp(name, "port", strlen("port")) || !isnum(name + strlen("port")))
+			continue;
 
-	while (port--) {
-		char port_val[MAX_LEN];
+		port = strtoud(name + strlen("port"));
+		if (port >= MAX_ADAPTERS - 1)
+			continue;
 
-		snprintf(port_val, sizeof(port_val), "port%u", port);
+		present[port] = true;
 
-		if (is_present_in_list(item, port_val)) {
+		if (port + 1 > ret)
 			ret = port + 1;
-			break;
-		}
 	}
 
-	free_list(item);
+	free_list(head);
 	free(root_cmd);
 
 	return ret;
 }
 
-static struct list_item* get_cap_vcap_start(struct list_item *regs_list,
-					    u8 cap_id, u8 vcap_id)
+/* Hash of the router name, used for indexing the router configs */
+static u64 hash_router_name(const char *router)
 {
-	u64 num_commas, col;
-	bool found = false;
-	s64 first, second;
-	char *regs, *str;
-	u64 total_col;
-
-	for (; regs_list; regs_list = regs_list->next) {
-		num_commas = 0;
-		col = 0;
-		regs = (char*)regs_list->val;
-		total_col = strlen(regs);
+	u64 hash = 0xcbf29ce484222325; /* FNV-1a */
 
-		for (; col < total_col; col++) {
-			if (num_commas == 2) {
-				u8 cap, vcap;
+	for (; *router; router++) {
+		hash ^= (u8)*router;
+		hash *= 0x100000001b3;
+	}
 
-				first = strpos(regs, ",", col);
-				if (first == -1)
-					break;
+	return hash;
+}
 
-				second = strpos(regs, ",", first + 1);
-				if (second == -1)
-					break;
+/*
+ * Builds the hash index from the router names to their configs.
+ * Index is open-addressed and kept at least half empty, hence the probing
+ * terminates quickly.
+ */
+static void build_routers_index(void)
+{
+	u64 i = 0, pos;
 
-				str = get_substr(regs, col, first - col);
-				cap = strtouh(str);
-				free(str);
+	routers_index_size = 1;
+	while (routers_index_size < 2 * total_routers_config)
+		routers_index_size <<= 1;
 
-				str = get_substr(regs, first + 1,
-						 second - first - 1);
-				vcap = strtouh(str);
-				free(str);
+	routers_index = calloc(routers_index_size, sizeof(struct router_config*));
 
-				if (cap == cap_id && vcap == vcap_id)
-					found = true;
+	for (; i < total_routers_config; i++) {
+		pos = hash_router_name(routers_config[i].router) & (routers_index_size - 1);
 
-				break;
-			} else if (regs[col] == ',')
-				num_commas++;
-		}
+		while (routers_index[pos])
+			pos = (pos + 1) & (routers_index_size - 1);
 
-		if (found)
-			return regs_list;
+		routers_index[pos] = &routers_config[i];
 	}
-
-	return NULL;
 }
 
-/* Fetches the router config. space of the provided router */
-static void get_router_regs(const char *router, struct router_config *config)
+/*
+ * Parses the 'regs' file at the provided debugfs path into the register dump.
+ * Each line of the file is either of the below:
+ * 1. <offset> <relative offset> <cap_id> <vcap_id> <value>
+ * 2. <offset> <not accessible>
+ *
+ * Returns the list of the capabilities found, in the order of appearance.
+ */
+static struct cap_start* parse_regs(const char *path, struct regs_dump *dump,
+				    u64 *total_caps)
 {
-	struct list_item *item, *router_regs;
-	char path[MAX_LEN], check[MAX_LEN];
+	u64 vals_size = 0, caps_size = 0, i;
+	char cmd[MAX_LEN], line[MAX_LEN];
+	u32 off, rel_off, cap, vcap, val;
+	struct cap_start *caps = NULL;
 	char *root_cmd;
+	FILE *file;
+	int ret;
 
-	snprintf(check, sizeof(check), "%s%s/regs", tbt_debugfs_path, router);
-	if (is_link_nabs(check))
-		exit(1);
+	memset(dump, 0, sizeof(struct regs_dump));
+	*total_caps = 0;
 
-	snprintf(path, sizeof(path), "cat %s%s/regs | awk -v OFS=',' '{\\$1=\\$1}1'",
-		 tbt_debugfs_path, router);
-	root_cmd = switch_cmd_to_root(path);
+	snprintf(cmd, sizeof(cmd), "cat 2>/dev/null %s", path);
+	root_cmd = switch_cmd_to_root(cmd);
+
+	file = popen(root_cmd, "r");
+	if (!file) {
+		free(root_cmd);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		ret = sscanf(line, "%x %u %x %x %x", &off, &rel_off, &cap, &vcap, &val);
+		if (ret <= 0)
+			continue;
+
+		if (dump->total == vals_size) {
+			vals_size = vals_size ? 2 * vals_size : 256;
+
+			dump->vals = realloc(dump->vals, vals_size * sizeof(u32));
+			dump->inaccessible = realloc(dump->inaccessible,
+						     (vals_size / 64) * sizeof(u64));
+			memset(dump->inaccessible + (dump->total / 64), 0,
+			       ((vals_size - dump->total) / 64) * sizeof(u64));
+		}
+
+		if (ret != 5) {
+			dump->vals[dump->total] = ~0;
+			dump->inaccessible[dump->total / 64] |= BIT(dump->total % 64);
 
-	router_regs = do_bash_cmd_list(root_cmd);
-	config->router_regs = router_regs;
+			dump->total++;
+			continue;
+		}
 
-	item = get_cap_vcap_start(router_regs, 0x0, 0x0);
-	config->regs = list_to_numbered_array(item);
+		dump->vals[dump->total] = val;
 
-	item = get_cap_vcap_start(router_regs, ROUTER_VCAP_ID,
-				  ROUTER_VSEC1_ID);
-	config->vsec1_regs = list_to_numbered_array(item);
+		for (i = 0; i < *total_caps; i++) {
+			if (caps[i].cap_id == cap && caps[i].vcap_id == vcap)
+				break;
+		}
 
-	item = get_cap_vcap_start(router_regs, ROUTER_VCAP_ID,
-				  ROUTER_VSEC3_ID);
-	config->vsec3_regs = list_to_numbered_array(item);
+		if (i == *total_caps) {
+			if (*total_caps == caps_size) {
+				caps_size = caps_size ? 2 * caps_size : 16;
+				caps = realloc(caps, caps_size * sizeof(struct cap_start));
+			}
 
-	item = get_cap_vcap_start(router_regs, ROUTER_VCAP_ID,
-				  ROUTER_VSEC4_ID);
-	config->vsec4_regs = list_to_numbered_array(item);
+			caps[i].cap_id = cap;
+			caps[i].vcap_id = vcap;
+			caps[i].start = dump->total;
 
-	item = get_cap_vcap_start(router_regs, ROUTER_VCAP_ID,
-				  ROUTER_VSEC6_ID);
-	config->vsec6_regs = list_to_numbered_array(item);
+			(*total_caps)++;
+		}
 
+		dump->total++;
+	}
+
+	pclose(file);
 	free(root_cmd);
+
+	return caps;
 }
 
 /*
- * Fetches the adapter config. space of all the ports present in the provided
- * router.
- *
- * NOTE: This assumes that the router has all the ports numbered '1' to the max.
- * adapter num - 1, obtained from 'get_total_adps_debugfs'.
+ * Returns the index of the first dword of the capability with the provided
+ * CAP_ID and VCAP_ID in the register dump, or '-1' if it's not present.
  */
-static void get_adps_config(const char *router, struct adp_config *config)
+static s64 get_cap_vcap_start(const struct cap_start *caps, u64 total_caps,
+			      u8 cap_id, u8 vcap_id)
 {
-	struct list_item *item, *adp_regs;
-	u8 total_adps;
-	u8 i = 0;
+	u64 i = 0;
 
-	total_adps = get_total_adps_debugfs(router);
+	for (; i < total_caps; i++) {
+		if (caps[i].cap_id == cap_id && caps[i].vcap_id == vcap_id)
+			return caps[i].start;
+	}
 
-	for (; i < total_adps; i++) {
-		char path[MAX_LEN], check[MAX_LEN];
-		char *root_cmd;
+	return -1;
+}
 
-		config[i].adp = i;
+/* Fetches the router config. space of the provided router */
+static void get_router_regs(const char *router, struct router_config *config)
+{
+	char path[MAX_LEN];
+	struct cap_start *caps;
+	u64 total_caps;
 
-		snprintf(check, sizeof(check), "%s%s/port%u/regs", tbt_debugfs_path,
-			 router, i);
-		if (is_link_nabs(check))
-			exit(1);
+	snprintf(path, sizeof(path), "%s%s/regs", tbt_debugfs_path, router);
+	if (is_link_nabs(path))
+		exit(1);
 
-		snprintf(path, sizeof(path),
-			 "cat 2>/dev/null %s%s/port%u/regs | awk -v OFS=',' '{\\$1=\\$1}1'",
-			 tbt_debugfs_path, router, i);
-		root_cmd = switch_cmd_to_root(path);
+	caps = parse_regs(path, &config->dump, &total_caps);
 
-		adp_regs = do_bash_cmd_list(root_cmd);
-		config[i].adp_regs = adp_regs;
+	config->regs = get_cap_vcap_start(caps, total_caps, 0x0, 0x0);
+	config->vsec1_regs = get_cap_vcap_start(caps, total_caps, ROUTER_VCAP_ID,
+						ROUTER_VSEC1_ID);
+	config->vsec3_regs = get_cap_vcap_start(caps, total_caps, ROUTER_VCAP_ID,
+						ROUTER_VSEC3_ID);
+	config->vsec4_regs = get_cap_vcap_start(caps, total_caps, ROUTER_VCAP_ID,
+						ROUTER_VSEC4_ID);
+	config->vsec6_regs = get_cap_vcap_start(caps, total_caps, ROUTER_VCAP_ID,
+						ROUTER_VSEC6_ID);
 
-		item = get_cap_vcap_start(adp_regs, 0, 0);
-		config[i].regs = list_to_numbered_array(item);
+	free(caps);
+}
 
-		item = get_cap_vcap_start(adp_regs,
-					  LANE_ADP_CAP_ID, 0);
-		config[i].lane_regs = list_to_numbered_array(item);
+/*
+ * Fetches the adapter config. space of all the ports present in the provided
+ * router. The configs are indexed by the adapter number.
+ */
+static void get_adps_config(const char *router, struct router_config *router_config)
+{
+	struct adp_config *config;
+	bool present[MAX_ADAPTERS];
+	struct cap_start *caps;
+	u64 total_caps;
+	u8 total_adps;
+	u8 i = 0;
 
-		item = get_cap_vcap_start(adp_regs,
-					  PCIE_ADP_CAP_ID, 0);
-		config[i].pcie_regs = list_to_numbered_array(item);
+	total_adps = get_adps_debugfs(router, present);
 
-		item = get_cap_vcap_start(adp_regs,
-					  DP_ADP_CAP_ID, 0);
-		config[i].dp_regs = list_to_numbered_array(item);
+	config = calloc(total_adps, sizeof(struct adp_config));
 
-		item = get_cap_vcap_start(adp_regs,
-					  USB3_ADP_CAP_ID, 0);
-		config[i].usb3_regs = list_to_numbered_array(item);
+	router_config->total_adps = total_adps;
+	router_config->adps_config = config;
 
-		item = get_cap_vcap_start(adp_regs,
-					  USB4_PORT_CAP_ID, 0);
-		config[i].usb4_port_regs = list_to_numbered_array(item);
+	for (; i < total_adps; i++) {
+		char path[MAX_LEN];
 
-		free(root_cmd);
-	}
-}
+		config[i].adp = i;
+		config[i].present = present[i];
 
-static u64 get_total_routers_in_domain(u8 domain)
-{
-	struct list_item *router, *head;
-	char path[MAX_LEN];
-	u64 num = 0;
+		if (!present[i]) {
+			config[i].regs = config[i].lane_regs = config[i].pcie_regs = -1;
+			config[i].dp_regs = config[i].usb3_regs = -1;
+			config[i].usb4_port_regs = -1;
 
-	snprintf(path, sizeof(path), "for line in $(ls %s); do echo $line; done",
-		 tbt_sysfs_path);
+			continue;
+		}
 
-	router = do_bash_cmd_list(path);
-	head = router;
+		snprintf(path, sizeof(path), "%s%s/port%u/regs", tbt_debugfs_path,
+			 router, i);
+		if (is_link_nabs(path))
+			exit(1);
 
-	for (; router; router = router->next) {
-		if (is_router_format((char*)router->val, domain))
-			num++;
+		caps = parse_regs(path, &config[i].dump, &total_caps);
+
+		config[i].regs = get_cap_vcap_start(caps, total_caps, 0, 0);
+		config[i].lane_regs = get_cap_vcap_start(caps, total_caps,
+							 LANE_ADP_CAP_ID, 0);
+		config[i].pcie_regs = get_cap_vcap_start(caps, total_caps,
+							 PCIE_ADP_CAP_ID, 0);
+		config[i].dp_regs = get_cap_vcap_start(caps, total_caps,
+						       DP_ADP_CAP_ID, 0);
+		config[i].usb3_regs = get_cap_vcap_start(caps, total_caps,
+							 USB3_ADP_CAP_ID, 0);
+		config[i].usb4_port_regs = get_cap_vcap_start(caps, total_caps,
+							      USB4_PORT_CAP_ID, 0);
+
+		free(caps);
 	}
-
-	free_list(head);
-
-	return num;
 }
 
 static struct router_config* get_router_config_item(const char *router)
 {
-	u64 domains, total_routers = 0;
-	u64 i = 0;
+	u64 pos;
 
-	domains = total_domains();
-	for (; i < domains; i++)
-		total_routers += get_total_routers_in_domain(i);
+	if (!routers_index)
+		return NULL;
 
-	for (i = 0; i < total_routers; i++) {
-		if (!strcmp(routers_config[i].router, router))
-			return &routers_config[i];
+	pos = hash_router_name(router) & (routers_index_size - 1);
+
+	for (; routers_index[pos]; pos = (pos + 1) & (routers_index_size - 1)) {
+		if (!strcmp(routers_index[pos]->router, router))
+			return routers_index[pos];
 	}
 
 	return NULL;
 }
 
-static struct adp_config* get_adp_config_item(const char *router,
-					      struct adp_config *configs, u8 adp)
+static struct adp_config* get_adp_config_item(const struct router_config *config, u8 adp)
 {
-	u64 i = 0, total_adps;
-
-	total_adps = get_total_adps_debugfs(router);
-
-	for (; i < total_adps; i++) {
-		if (configs[i].adp == adp)
-			return &configs[i];
-	}
+	if (adp >= config->total_adps || !config->adps_config[adp].present)
+		return NULL;
 
-	return NULL;
+	return &config->adps_config[adp];
 }
 
 /*
- * Returns 'true' if the provided config. space offset string has no valid
- * values (contains 'not accessible').
- *
- * Caller needs to ensure that the argument is valid.
+ * Returns the register value at the given offset from the capability starting at
+ * 'start' in the register dump.
+ * Return a value of (u64)~0 if the capability is absent, or the offset is out of
+ * bounds or inaccessible.
  */
-static bool is_offset_inaccessible(const char *regs)
+static u64 get_register_val(const struct regs_dump *dump, s64 start, u64 off)
 {
-	int pos;
-
-	pos = strpos(regs, "not", 0);
-	if (pos == -1)
-		return false;
+	u64 i;
 
-	return true;
-}
-
-static u64 get_register_val(char **regs_list, u64 off)
-{
-	u64 total_col;
-
-	if (!regs_list || !(*regs_list))
+	if (start < 0)
 		return COMPLEMENT_BIT64;
 
-	if (is_offset_inaccessible(regs_list[off]))
+	i = start + off;
+	if (i >= dump->total)
 		return COMPLEMENT_BIT64;
 
-	total_col = strlen(regs_list[off]);
+	if (dump->inaccessible[i / 64] & BIT(i % 64))
+		return COMPLEMENT_BIT64;
 
-	return strtouh(regs_list[off] + (total_col - 10));
+	return dump->vals[i];
 }
 
 /* Returns 'true' if debugfs in mounted, 'false' otherwise */
@@ -353,7 +407,6 @@ static int debugfs_config_init(void)
 	u64 total_routers, i;
 	char path[MAX_LEN];
 	bool debugfs_en;
-	u8 adps;
 
 	debugfs_en = is_debugfs_enabled();
 	if (!debugfs_en) {
@@ -377,110 +430,60 @@ static int debugfs_config_init(void)
 		strcpy(router, (char*)router_list->val);
 		router[strlen((char*)router_list->val)] = '\0';
 
-		adps = get_total_adps_debugfs(router);
-
 		routers_config[i].router = router;
 		get_router_regs(router, &routers_config[i]);
-
-		routers_config[i].adps_config = malloc(adps *
-						       sizeof(struct adp_config));
-		get_adps_config(router, routers_config[i].adps_config);
+		get_adps_config(router, &routers_config[i]);
 
 		i++;
 	}
 
+	total_routers_config = total_routers;
+	build_routers_index();
+
 	free_list(head);
 	free(root_cmd);
 
 	return 0;
 }
 
-static void free_router_regs(struct router_config *config, char **regs, u8 cap_id,
-			     u8 vcap_id)
+static void free_regs_dump(struct regs_dump *dump)
 {
-	struct list_item *item;
-	u64 num, i = 0;
-
-	item = get_cap_vcap_start(config->router_regs, cap_id, vcap_id);
-	num = get_total_list_items(item);
-
-	for (; i < num; i++)
-		free(regs[i]);
-
-	free(regs);
+	free(dump->vals);
+	free(dump->inaccessible);
 }
 
 static void free_router_config(struct router_config *config)
 {
 	free(config->router);
-
-	free_router_regs(config, config->regs, 0x0, 0x0);
-	free_router_regs(config, config->vsec1_regs, ROUTER_VCAP_ID, ROUTER_VSEC1_ID);
-	free_router_regs(config, config->vsec3_regs, ROUTER_VCAP_ID, ROUTER_VSEC3_ID);
-	free_router_regs(config, config->vsec4_regs, ROUTER_VCAP_ID, ROUTER_VSEC4_ID);
-	free_router_regs(config, config->vsec6_regs, ROUTER_VCAP_ID, ROUTER_VSEC6_ID);
-
-	free_list(config->router_regs);
+	free_regs_dump(&config->dump);
 }
 
-static void free_adp_regs(struct adp_config *config, char **regs, u8 cap_id,
-			  u8 vcap_id)
+static void free_adp_config(struct router_config *config)
 {
-	struct list_item *item;
-	u64 num, i = 0;
-
-	item = get_cap_vcap_start(config->adp_regs, cap_id, vcap_id);
-	num = get_total_list_items(item);
-
-	for (; i < num; i++)
-		free(regs[i]);
-
-	free(regs);
-}
-
-static void free_adp_config(char *router, struct adp_config *config)
-{
-	u8 total_adps = get_total_adps_debugfs(router);
 	u8 i = 0;
 
-	for (; i < total_adps; i++) {
-		free_adp_regs(&config[i], config[i].regs, 0x0, 0x0);
-		free_adp_regs(&config[i], config[i].lane_regs, LANE_ADP_CAP_ID, 0x0);
-		free_adp_regs(&config[i], config[i].pcie_regs, PCIE_ADP_CAP_ID, 0x0);
-		free_adp_regs(&config[i], config[i].dp_regs, DP_ADP_CAP_ID, 0x0);
-		free_adp_regs(&config[i], config[i].usb3_regs, USB3_ADP_CAP_ID, 0x0);
-		free_adp_regs(&config[i], config[i].usb4_port_regs, USB4_PORT_CAP_ID, 0x0);
-
-		free_list(config[i].adp_regs);
-	}
+	for (; i < config->total_adps; i++)
+		free_regs_dump(&config->adps_config[i].dump);
 
-	free(config);
+	free(config->adps_config);
 }
 
 /* Free the memory explicitly used for debugfs operations */
 static void debugfs_config_exit(void)
 {
-	struct list_item *router_list;
-	u64 total_routers = 0;
-	char path[MAX_LEN];
-	char *root_cmd;
-	u8 i;
-
-	snprintf(path, sizeof(path), "ls %s", tbt_debugfs_path);
-	root_cmd = switch_cmd_to_root(path);
-
-	router_list = do_bash_cmd_list(root_cmd);
-	total_routers = get_total_list_items(router_list);
+	u64 i = 0;
 
-	for (i = 0; i < total_routers; i++) {
-		free_adp_config(routers_config[i].router, routers_config[i].adps_config);
+	for (; i < total_routers_config; i++) {
+		free_adp_config(&routers_config[i]);
 		free_router_config(&routers_config[i]);
 	}
 
 	free(routers_config);
+	free(routers_index);
 
-	free_list(router_list);
-	free(root_cmd);
+	routers_config = NULL;
+	routers_index = NULL;
+	total_routers_config = routers_index_size = 0;
 }
 
 /*
@@ -490,43 +493,30 @@ static void debugfs_config_exit(void)
  */
 bool is_adp_present(const char *router, u8 adp)
 {
-	char path[MAX_LEN];
-	char *root_cmd;
-	char *output;
-
-	snprintf(path, sizeof(path), "ls 2>/dev/null %s%s/port%u | wc -l", tbt_debugfs_path,
-		 router, adp);
-	root_cmd = switch_cmd_to_root(path);
+	struct router_config *config = get_router_config_item(router);
 
-	output = do_bash_cmd(root_cmd);
-	if (strtoud(output)) {
-		free(output);
-		free(root_cmd);
+	if (!config)
+		return false;
 
-		return true;
-	}
+	return get_adp_config_item(config, adp) != NULL;
+}
 
-	free(output);
-	free(root_cmd);
+/*
+ * Returns the directory fd of the thunderbolt sysfs path, which is opened once
+ * and then used as the base for all the attribute reads.
+ */
+int get_tbt_sysfs_fd(void)
+{
+	if (tbt_sysfs_fd < 0)
+		tbt_sysfs_fd = open_sysfs_dir(tbt_sysfs_path);
 
-	return false;
+	return tbt_sysfs_fd;
 }
 
 /* Returns the total no. of domains in the host */
 u8 total_domains(void)
 {
-	char path[MAX_LEN];
-	char *output;
-	u32 val;
-
-	snprintf(path, sizeof(path), "ls 2>/dev/null %s | grep domain | wc -l",
-		 tbt_sysfs_path);
-
-	output = do_bash_cmd(path);
-	val = strtoud(output);
-
-	free(output);
-	return val;
+	return get_topology()->domains;
 }
 
 /* Validate the arguments for 'lstbt', 'lstbt -t', and 'lstbt -v' */
@@ -564,19 +554,7 @@ bool validate_args(char *domain, char *depth, const char *device)
 /* Returns 'true' if the router exists, 'false' otherwise */
 bool is_router_present(const char *router)
 {
-	char path[MAX_LEN];
-	char *bash;
-
-	snprintf(path, sizeof(path), "ls %s%s %s; echo $?", tbt_sysfs_path,
-		 router, REDIRECTED_NULL);
-	bash = do_bash_cmd(path);
-	if (strtoud(bash)) {
-		free(bash);
-		return false;
-	}
-
-	free(bash);
-	return true;
+	return find_router(router) != NULL;
 }
 
 /*
@@ -639,41 +617,26 @@ bool is_router_depth(const char *router, u8 depth)
 /* Dump the router's vendor/device IDs */
 void dump_vdid(const char *router)
 {
-	char vid_path[MAX_LEN], did_path[MAX_LEN], vcheck[MAX_LEN], dcheck[MAX_LEN];
-	char *vid, *did;
-
-	snprintf(vcheck, sizeof(vcheck), "%s%s/vendor", tbt_sysfs_path, router);
-	snprintf(dcheck, sizeof(dcheck), "%s%s/device", tbt_sysfs_path, router);
-	if (is_link_nabs(vcheck) || is_link_nabs(dcheck))
-		exit(1);
-
-	snprintf(vid_path, sizeof(vid_path), "cat %s%s/vendor", tbt_sysfs_path, router);
-	vid = do_bash_cmd(vid_path);
+	u32 vid = 0, did = 0;
+	char path[MAX_LEN];
 
-	snprintf(did_path, sizeof(did_path), "cat %s%s/device", tbt_sysfs_path, router);
-	did = do_bash_cmd(did_path);
+	snprintf(path, sizeof(path), "%s/vendor", router);
+	read_sysfs_attr_hex(get_tbt_sysfs_fd(), path, &vid);
 
-	printf("ID %04x:%04x ", strtouh(vid), strtouh(did));
+	snprintf(path, sizeof(path), "%s/device", router);
+	read_sysfs_attr_hex(get_tbt_sysfs_fd(), path, &did);
 
-	free(vid);
-	free(did);
+	printf("ID %04x:%04x ", vid, did);
 }
 
 /* Dump the generation of the router */
 void dump_generation(const char *router)
 {
-	char gen[MAX_LEN], check[MAX_LEN];
-	u8 generation;
-	char *gen_str;
-
-	snprintf(check, sizeof(check), "%s%s/generation", tbt_sysfs_path, router);
-	if (is_link_nabs(check))
-		exit(1);
-
-	snprintf(gen, sizeof(gen), "cat %s%s/generation", tbt_sysfs_path, router);
+	u32 generation = 0;
+	char path[MAX_LEN];
 
-	gen_str = do_bash_cmd(gen);
-	generation = strtoud(gen_str);
+	snprintf(path, sizeof(path), "%s/generation", router);
+	read_sysfs_attr_u32(get_tbt_sysfs_fd(), path, &generation);
 
 	switch(generation) {
 	case 1:
@@ -691,93 +654,81 @@ void dump_generation(const char *router)
 	default:
 		printf("(Unknown)\n");
 	}
-
-	free(gen_str);
 }
 
 /* Dump the NVM version of the router */
 void dump_nvm_version(const char *router)
 {
-	char path[MAX_LEN], check[MAX_LEN];
+	char path[MAX_LEN];
 	char *nvm;
 
-	snprintf(check, sizeof(check), "%s%s/nvm_version", tbt_sysfs_path, router);
-	if (is_link_nabs(check))
-		exit(1);
-
-	snprintf(path, sizeof(path), "cat %s%s/nvm_version", tbt_sysfs_path, router);
-	nvm = do_bash_cmd(path);
-
-	printf("NVM %s, ", nvm);
+	snprintf(path, sizeof(path), "%s/nvm_version", router);
+	nvm = read_sysfs_attr(get_tbt_sysfs_fd(), path);
 
-	free(nvm);
+	printf("NVM %s, ", nvm ? nvm : "<Not accessible>");
 }
 
 /* Dump the lanes used by the router at once */
 void dump_lanes(const char *router)
 {
-	char path[MAX_LEN], check[MAX_LEN];
-	char str[MAX_LEN];
+	char path[MAX_LEN];
 	char *lanes;
 
-	if (is_host_router(router)) {
-		sprintf(str, "%s", "");
+	if (is_host_router(router))
 		return;
-	}
 
-	snprintf(check, sizeof(check), "%s%s/tx_lanes", tbt_sysfs_path, router);
-	if (is_link_nabs(check))
-		exit(1);
-
-	snprintf(path, sizeof(path), "cat %s%s/tx_lanes", tbt_sysfs_path, router);
-	lanes = do_bash_cmd(path);
-	printf("x%s", lanes);
+	snprintf(path, sizeof(path), "%s/tx_lanes", router);
+	lanes = read_sysfs_attr(get_tbt_sysfs_fd(), path);
 
-	free(lanes);
+	printf("x%s", lanes ? lanes : "<Not accessible>");
 }
 
 /* Dump the router's speed per lane */
 void dump_speed(const char *router)
 {
-	char path[MAX_LEN], check[MAX_LEN];
-	char str[MAX_LEN];
+	char path[MAX_LEN];
 	char *speed_str;
 
-	if (is_host_router(router)) {
-		sprintf(str, "%s", "");
+	if (is_host_router(router))
 		return;
-	}
-
-	snprintf(check, sizeof(check), "%s%s/tx_speed", tbt_sysfs_path, router);
-	if (is_link_nabs(check))
-		exit(1);
-
-	snprintf(path, sizeof(path), "cat %s%s/tx_speed", tbt_sysfs_path, router);
 
-	speed_str = do_bash_cmd(path);
-	printf("%s, ", speed_str);
+	snprintf(path, sizeof(path), "%s/tx_speed", router);
+	speed_str = read_sysfs_attr(get_tbt_sysfs_fd(), path);
 
-	free(speed_str);
+	printf("%s, ", speed_str ? speed_str : "<Not accessible>");
 }
 
 /* Dump the authentication status, depicting PCIe tunneling */
 void dump_auth_sts(const char *router)
 {
-	char path[MAX_LEN], check[MAX_LEN];
-	char *auth_str;
-	bool auth;
-
-	snprintf(check, sizeof(check), "%s%s/authorized", tbt_sysfs_path, router);
-	if (is_link_nabs(check))
-		exit(1);
+	char path[MAX_LEN];
+	u32 auth = 0;
 
-	snprintf(path, sizeof(path), "cat %s%s/authorized", tbt_sysfs_path, router);
+	snprintf(path, sizeof(path), "%s/authorized", router);
+	read_sysfs_attr_u32(get_tbt_sysfs_fd(), path, &auth);
 
-	auth_str = do_bash_cmd(path);
-	auth = strtoud(auth_str);
 	printf("Auth:%s\n", (auth == 1) ? "Yes" : "No");
+}
+
+/*
+ * Dump the vendor/device name of the router (or any thunderbolt device having the
+ * name attributes).
+ */
+void dump_name(const char *router)
+{
+	char path[MAX_LEN], vendor[MAX_LEN];
+	char *attr;
+
+	snprintf(path, sizeof(path), "%s/vendor_name", router);
+	attr = read_sysfs_attr(get_tbt_sysfs_fd(), path);
+
+	/* Attribute buffer gets reused by the next read */
+	snprintf(vendor, sizeof(vendor), "%s", attr ? attr : "<Not accessible>");
+
+	snprintf(path, sizeof(path), "%s/device_name", router);
+	attr = read_sysfs_attr(get_tbt_sysfs_fd(), path);
 
-	free(auth_str);
+	printf("%s %s ", vendor, attr ? attr : "<Not accessible>");
 }
 
 /* Returns the depth of the given valid router string */
@@ -809,7 +760,7 @@ u8 domain_of_router(const char *router)
 u64 get_router_register_val(const char *router, u8 cap_id, u8 vcap_id, u64 off)
 {
 	struct router_config *config;
-	char **regs = NULL;
+	s64 regs = -1;
 
 	config = get_router_config_item(router);
 	if (!config)
@@ -826,7 +777,7 @@ u64 get_router_register_val(const char *router, u8 cap_id, u8 vcap_id, u64 off)
 	else if (cap_id == ROUTER_VCAP_ID && vcap_id == ROUTER_VSEC6_ID)
 		regs = config->vsec6_regs;
 
-	return get_register_val(regs, off);
+	return get_register_val(&config->dump, regs, off);
 }
 
 /*
@@ -841,13 +792,13 @@ u64 get_adapter_register_val(const char *router, u8 cap_id, u8 sec_id, u8 adp, u
 {
 	struct router_config *router_config;
 	struct adp_config *adp_config;
-	char **regs = NULL;
+	s64 regs = -1;
 
 	router_config = get_router_config_item(router);
 	if (!router_config)
 		return COMPLEMENT_BIT64;
 
-	adp_config = get_adp_config_item(router, router_config->adps_config, adp);
+	adp_config = get_adp_config_item(router_config, adp);
 	if (!adp_config)
 		return COMPLEMENT_BIT64;
 
@@ -864,7 +815,7 @@ u64 get_adapter_register_val(const char *router, u8 cap_id, u8 sec_id, u8 adp, u
 	else if (cap_id == DP_ADP_CAP_ID && sec_id == DP_ADP_SEC_ID)
 		regs = adp_config->dp_regs;
 
-	return get_register_val(regs, off);
+	return get_register_val(&adp_config->dump, regs, off);
 }
 
 /*
@@ -10,6 +10,7 @@
 #include "../utils.h"
 #include "adapter.h"
 #include "router.h"
+#include "topology.h"
 
 /* Maximum adapters possible in a router */
 #define MAX_ADAPTERS		64
@@ -22,34 +23,52 @@
 
 extern char *tbt_sysfs_path;
 
+/*
+ * Register values parsed from a 'regs' file in the debugfs, stored in the order
+ * they are present in the file.
+ */
+struct regs_dump {
+	u32 *vals;
+	u64 *inaccessible;	/* Bitmap of the dwords marked '<not accessible>' */
+	u64 total;
+};
+
+/*
+ * The capability members below hold the index of the first dword of the
+ * respective capability in the register dump, or '-1' if it is absent.
+ */
 struct adp_config {
 	u8 adp;
-	struct list_item *adp_regs;
+	bool present;
+	struct regs_dump dump;
 
-	char **regs;
-	char **lane_regs;
-	char **pcie_regs;
-	char **dp_regs;
-	char **usb3_regs;
-	char **usb4_port_regs;
+	s64 regs;
+	s64 lane_regs;
+	s64 pcie_regs;
+	s64 dp_regs;
+	s64 usb3_regs;
+	s64 usb4_port_regs;
 };
 
 struct router_config {
 	char *router;
-	struct list_item *router_regs;
+	struct regs_dump dump;
 
-	char **regs;
-	char **vsec1_regs;
-	char **vsec3_regs;
-	char **vsec4_regs;
-	char **vsec6_regs;
+	s64 regs;
+	s64 vsec1_regs;
+	s64 vsec3_regs;
+	s64 vsec4_regs;
+	s64 vsec6_regs;
 
+	/* Indexed by the adapter number */
+	u8 total_adps;
 	struct adp_config *adps_config;
 };
 
 extern char *help_msg;
 
 bool is_adp_present(const char *router, u8 adp);
+int get_tbt_sysfs_fd(void);
 u8 total_domains(void);
 bool validate_args(char *domain, char *depth, const char *device);
 bool is_router_present(const char *router);
@@ -63,6 +82,7 @@ void dump_generation(const char *router);
 void dump_lanes(const char *router);
 void dump_speed(const char *router);
 void dump_auth_sts(const char *router);
+void dump_name(const char *router);
 u8 depth_of_router(const char *router);
 u8 domain_of_router(const char *router);
 u64 get_router_register_val(const char *router, u8 cap_id, u8 vcap_id, u64 off);
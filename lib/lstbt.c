@@ -23,29 +23,6 @@
 
 #define APPEND_HEX_CHAR		2
 
-/* Dump the vendor/device name of the router */
-static void dump_name(const char *router)
-{
-	char v_path[MAX_LEN], d_path[MAX_LEN], vcheck[MAX_LEN], dcheck[MAX_LEN];
-	char *vendor, *device;
-
-	snprintf(vcheck, sizeof(vcheck), "%s%s/vendor_name", tbt_sysfs_path, router);
-	snprintf(dcheck, sizeof(dcheck), "%s%s/device_name", tbt_sysfs_path, router);
-	if (is_link_nabs(vcheck) || is_link_nabs(dcheck))
-		exit(1);
-
-	snprintf(v_path, sizeof(v_path), "cat %s%s/vendor_name", tbt_sysfs_path, router);
-	vendor = do_bash_cmd(v_path);
-
-	snprintf(d_path, sizeof(d_path), "cat %s%s/device_name", tbt_sysfs_path, router);
-	device = do_bash_cmd(d_path);
-
-	printf("%s %s ", vendor, device);
-
-	free(vendor);
-	free(device);
-}
-
 static bool dump_router(const char *router)
 {
 	u8 domain, depth;
@@ -82,35 +59,23 @@ static bool dump_router(const char *router)
  */
 static bool enumerate_domain(u8 domain, char *depth)
 {
-	struct list_item *router, *head;
-	char path[MAX_LEN];
+	struct tbt_topology *top = get_topology();
+	struct tbt_router *router;
 	bool found = false;
+	u64 i = 0;
 
-	snprintf(path, sizeof(path), "for line in $(ls %s); do echo $line; done",
-		 tbt_sysfs_path);
-
-	router = do_bash_cmd_list(path);
-	head = router;
+	for (; i < top->total_routers; i++) {
+		router = &top->routers[i];
 
-	if (depth) {
-		for(; router != NULL; router = router->next) {
-			if (!is_router_format((char*)router->val, domain))
-				continue;
+		if (router->domain != domain)
+			continue;
 
-			if (is_router_depth((char*)router->val, strtoud(depth)))
-				found |= dump_router((char*)router->val);
-		}
-	} else {
-		for(; router != NULL; router = router->next) {
-			if (!is_router_format((char*)router->val, domain))
-				continue;
+		if (depth && router->depth != strtoud(depth))
+			continue;
 
-			found |= dump_router((char*)router->val);
-		}
+		found |= dump_router(router->name);
 	}
 
-	free_list(head);
-
 	return found;
 }
 
@@ -237,6 +202,8 @@ int main(int argc, char **argv)
 
 	ret = __main(domain, depth, device, retimer, tree, verbose);
 
+	free_topology();
+
 out:
 	for (i = 0; i < MAX_LEN * MAX_LEN; i++) {
 		if (!arr[i])
@@ -16,121 +16,39 @@
 
 #include "helpers.h"
 
-/*
- * Check if the given string is in retimer string format.
- * Cases are limited for a thunderbolt directory.
- */
-static bool is_retimer_format(const char *retimer, u8 domain)
-{
-	char num_str[MAX_LEN];
-	char *colon_str = ":";
-	int pos;
-
-	snprintf(num_str, sizeof(num_str), "%u-", domain);
-
-	pos = strpos(retimer, num_str, 0);
-	if (pos)
-		return false;
-
-	pos = strpos(retimer, colon_str, 0);
-	if (pos <= 0)
-		return false;
-
-	return true;
-}
-
-/*
- * Returns 'true' if the provided retimer is present in the given router,
- * 'false' otherwise.
- */
-static bool is_retimer_in_router(const char *retimer, const char *router)
-{
-	char *rtr;
-	int pos;
-
-	pos = strpos(retimer, ":", 0);
-	if (pos < 0)
-		return false;
-
-	rtr = get_substr(retimer, 0, pos);
-
-	if (strcmp(rtr, router)) {
-		free(rtr);
-		return false;
-	}
-
-	free(rtr);
-
-	return true;
-}
-
 /* Dumps the retimer f/w version */
 static void dump_retimer_nvm_version(const char *retimer)
 {
-	char path[MAX_LEN], check[MAX_LEN];
+	char path[MAX_LEN];
 	char *ver;
 
-	snprintf(check, sizeof(check), "%s%s/nvm_version", tbt_sysfs_path, retimer);
-	if (is_link_nabs(check))
-		exit(1);
+	snprintf(path, sizeof(path), "%s/nvm_version", retimer);
+	ver = read_sysfs_attr(get_tbt_sysfs_fd(), path);
 
-	snprintf(path, sizeof(path), "cat %s%s/nvm_version", tbt_sysfs_path,
-		 retimer);
-
-	ver = do_bash_cmd(path);
-	printf("NVM %s\n", ver);
-
-	free(ver);
+	printf("NVM %s\n", ver ? ver : "<Not accessible>");
 }
 
 /* Dumps the retimer */
-static bool dump_retimer(const char *retimer)
+static bool dump_retimer(const struct tbt_retimer *retimer)
 {
-	char vid_path[MAX_LEN], did_path[MAX_LEN], vcheck[MAX_LEN], dcheck[MAX_LEN];
-	int pos, dot_pos;
-	char *vid, *did;
-	u8 domain, port;
-	char *router;
-	char *str;
-
-	str = get_substr(retimer, 0, 1);
-	domain = strtoud(str);
-	free(str);
-
-	pos = strpos(retimer, ":", 0);
-	if (pos < 0)
-		return false;
-
-	router = get_substr(retimer, 0, pos);
+	u32 vid = 0, did = 0;
+	char path[MAX_LEN];
 
-	dot_pos = strpos(retimer, ".", pos);
-	if (dot_pos < 0) {
-		free(router);
+	if (!retimer->router)
 		return false;
-	}
-
-	port = strtoud(get_substr(retimer, pos + 1, dot_pos - pos - 1));
-
-	printf("Domain %u Router %s: Port %u: ", domain, router, port);
-
-	snprintf(vcheck, sizeof(vcheck), "%s%s/vendor", tbt_sysfs_path, retimer);
-	snprintf(dcheck, sizeof(dcheck), "%s%s/device", tbt_sysfs_path, retimer);
-	if (is_link_nabs(vcheck) || is_link_nabs(dcheck))
-		exit(1);
 
-	snprintf(vid_path, sizeof(vid_path), "cat %s%s/vendor", tbt_sysfs_path, retimer);
-	vid = do_bash_cmd(vid_path);
+	printf("Domain %u Router %s: Port %u: ", retimer->domain, retimer->router->name,
+	       retimer->port);
 
-	snprintf(did_path, sizeof(did_path), "cat %s%s/device", tbt_sysfs_path, retimer);
-	did = do_bash_cmd(did_path);
+	snprintf(path, sizeof(path), "%s/vendor", retimer->name);
+	read_sysfs_attr_hex(get_tbt_sysfs_fd(), path, &vid);
 
-	printf("ID %04x:%04x ", strtouh(vid), strtouh(did));
+	snprintf(path, sizeof(path), "%s/device", retimer->name);
+	read_sysfs_attr_hex(get_tbt_sysfs_fd(), path, &did);
 
-	dump_retimer_nvm_version(retimer);
+	printf("ID %04x:%04x ", vid, did);
 
-	free(vid);
-	free(did);
-	free(router);
+	dump_retimer_nvm_version(retimer->name);
 
 	return true;
 }
@@ -138,59 +56,35 @@ static bool dump_retimer(const char *retimer)
 /* Dumps the retimers (if any) present in the provided domain */
 static bool enumerate_retimers_in_domain(u8 domain)
 {
-	struct list_item *retimer, *head;
-	char path[MAX_LEN];
+	struct tbt_topology *top = get_topology();
 	bool found = false;
+	u64 i = 0;
 
-	snprintf(path, sizeof(path), "for line in $(ls %s); do echo $line; done",
-		 tbt_sysfs_path);
-
-	retimer = do_bash_cmd_list(path);
-	head = retimer;
-
-	for (; retimer; retimer = retimer->next) {
-		if (!is_retimer_format((char*)retimer->val, domain))
+	for (; i < top->total_retimers; i++) {
+		if (top->retimers[i].domain != domain)
 			continue;
 
-		found |= dump_retimer((char*)retimer->val);
+		found |= dump_retimer(&top->retimers[i]);
 	}
 
-	free_list(head);
-
 	return found;
 }
 
 /* Dumps the retimers (if any) present on any port in the provided router */
 static bool dump_retimers_in_router(const char *router)
 {
-	struct list_item *retimer, *head;
-	char path[MAX_LEN];
+	struct tbt_topology *top = get_topology();
+	struct tbt_router *rtr = find_router(router);
 	bool found = false;
-	u8 domain;
-	char *str;
-
-	str = get_substr(router, 0, 1);
-	domain = strtoud(str);
-	free(str);
+	u64 i = 0;
 
-	snprintf(path, sizeof(path), "for line in $(ls %s); do echo $line; done",
-		 tbt_sysfs_path);
-
-	retimer = do_bash_cmd_list(path);
-	head = retimer;
-
-	for (; retimer; retimer = retimer->next) {
-		if (!is_retimer_format((char*)retimer->val, domain))
+	for (; i < top->total_retimers; i++) {
+		if (top->retimers[i].router != rtr)
 			continue;
 
-		if (!is_retimer_in_router((char*)retimer->val, router))
-			continue;
-
-		found |= dump_retimer((char*)retimer->val);
+		found |= dump_retimer(&top->retimers[i]);
 	}
 
-	free_list(head);
-
 	return found;
 }
 
@@ -17,12 +17,6 @@
 
 #define VERBOSE_SPACES	4
 
-/* Returns 'true' if the router is in the provided domain, 'false' otherwise */
-static inline bool is_router_domain(const char *router, u8 domain)
-{
-	return domain_of_router(router) == domain;
-}
-
 /* Depth here refers to the depth in the topological output */
 static inline u8 total_whitespace(u8 depth)
 {
@@ -63,29 +57,6 @@ static inline u8 downstream_port(const char *router)
 	return port;
 }
 
-/* Dump the vendor/device name of the router */
-static void dump_name(const char *router)
-{
-	char v_path[MAX_LEN], d_path[MAX_LEN], vcheck[MAX_LEN], dcheck[MAX_LEN];
-	char *vendor, *device;
-
-	snprintf(vcheck, sizeof(vcheck), "%s%s/vendor_name", tbt_sysfs_path, router);
-	snprintf(dcheck, sizeof(dcheck), "%s%s/device_name", tbt_sysfs_path, router);
-	if (is_link_nabs(vcheck) || is_link_nabs(dcheck))
-		exit(1);
-
-	snprintf(v_path, sizeof(v_path), "cat %s%s/vendor_name", tbt_sysfs_path, router);
-	vendor = do_bash_cmd(v_path);
-
-	snprintf(d_path, sizeof(d_path), "cat %s%s/device_name", tbt_sysfs_path, router);
-	device = do_bash_cmd(d_path);
-
-	printf("%s %s ", vendor, device);
-
-	free(vendor);
-	free(device);
-}
-
 /*
  * Dump the router for 'lstbt -t' operation.
  *
@@ -134,29 +105,14 @@ static void dump_router(const char *router, u8 depth, bool verbose)
  * @depth: Depth is the row number of the router enumeration in the output console.
  * @verbose: 'True' if verbose output is needed, 'false' otherwise.
  */
-static bool enumerate_dev_tree(const char *router, u8 depth, bool verbose)
+static bool enumerate_dev_tree(const struct tbt_router *router, u8 depth, bool verbose)
 {
-	u8 domain = domain_of_router(router);
-	struct list_item *item, *head;
-	char path[MAX_LEN];
-	bool found = false;
-
-	dump_router(router, depth, verbose);
-
-	snprintf(path, sizeof(path), "for line in $(ls %s%s); do echo $line; done",
-		 tbt_sysfs_path, router);
+	struct tbt_router *child = router->child;
 
-	item = do_bash_cmd_list(path);
-	head = item;
+	dump_router(router->name, depth, verbose);
 
-	for (; item != NULL; item = item->next) {
-		if (!is_router_format((char*)item->val, domain))
-			continue;
-
-		found |= enumerate_dev_tree((char*)item->val, depth + 1, verbose);
-	}
-
-	free_list(head);
+	for (; child; child = child->sibling)
+		enumerate_dev_tree(child, depth + 1, verbose);
 
 	return true;
 }
@@ -169,41 +125,26 @@ static bool enumerate_dev_tree(const char *router, u8 depth, bool verbose)
  */
 static bool enumerate_domain_tree(u8 domain, char *depth, bool verbose)
 {
-	struct list_item *router, *head;
-	char path[MAX_LEN];
+	struct tbt_topology *top = get_topology();
+	struct tbt_router *router;
 	bool found = false;
+	u64 i = 0;
 
-	snprintf(path, sizeof(path), "for line in $(ls %s); do echo $line; done",
-		 tbt_sysfs_path);
-
-	router = do_bash_cmd_list(path);
-	head = router;
+	for (; i < top->total_routers; i++) {
+		router = &top->routers[i];
 
-	if (depth) {
-		for(; router != NULL; router = router->next) {
-			if (!is_router_format((char*)router->val, domain))
-				continue;
+		if (router->domain != domain)
+			continue;
 
-			if (is_router_depth((char*)router->val, strtoud(depth)))
-				found |= enumerate_dev_tree((char*)router->val, 0,
-							    verbose);
-		}
-	} else {
-		for(; router != NULL; router = router->next) {
-			if (!is_router_format((char*)router->val, domain))
-				continue;
-
-			if (is_host_router((char*)router->val) &&
-			    is_router_domain((char*)router->val, domain)) {
-				found |= enumerate_dev_tree((char*)router->val, 0,
-							    verbose);
-				break;
-			}
+		if (depth) {
+			if (router->depth == strtoud(depth))
+				found |= enumerate_dev_tree(router, 0, verbose);
+		} else if (!router->depth) {
+			found |= enumerate_dev_tree(router, 0, verbose);
+			break;
 		}
 	}
 
-	free_list(head);
-
 	return found;
 }
 
@@ -233,7 +174,7 @@ int lstbt_t(char *domain, char *depth, char *device, bool verbose)
 			return 1;
 		}
 
-		enumerate_dev_tree(device, 0, verbose);
+		enumerate_dev_tree(find_router(device), 0, verbose);
 		return 0;
 	}
 
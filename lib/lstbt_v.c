@@ -9,6 +9,7 @@
  * Copyright (C) 2023 Intel Corporation
  */
 
+#include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -20,29 +21,6 @@
 #define VERBOSE_L2_SPACES		29
 #define VERBOSE_L3_SPACES		37
 
-/* Dump the vendor/device name of the router */
-static void dump_name(const char *router)
-{
-	char v_path[MAX_LEN], d_path[MAX_LEN], vcheck[MAX_LEN], dcheck[MAX_LEN];
-	char *vendor, *device;
-
-	snprintf(vcheck, sizeof(vcheck), "%s%s/vendor_name", tbt_sysfs_path, router);
-	snprintf(dcheck, sizeof(dcheck), "%s%s/device_name", tbt_sysfs_path, router);
-	if (is_link_nabs(vcheck) || is_link_nabs(dcheck))
-		exit(1);
-
-	snprintf(v_path, sizeof(v_path), "cat %s%s/vendor_name", tbt_sysfs_path, router);
-	vendor = do_bash_cmd(v_path);
-
-	snprintf(d_path, sizeof(d_path), "cat %s%s/device_name", tbt_sysfs_path, router);
-	device = do_bash_cmd(d_path);
-
-	printf("%s %s ", vendor, device);
-
-	free(vendor);
-	free(device);
-}
-
 static void dump_spaces(u64 spaces)
 {
 	while (spaces--)
@@ -93,17 +71,22 @@ static void dump_tbt_compatibility(const char *router)
 static char* get_upstream_router(char *router)
 {
 	char *ups_router = malloc(MAX_LEN * sizeof(char));
-	char path[MAX_LEN];
+	char output[MAX_LEN];
 	u64 pos1, pos2;
-	char *output;
+	ssize_t len;
+
+	memset(ups_router, '\0', MAX_LEN * sizeof(char));
 
 	if (is_host_router(router)) {
 		strcpy(ups_router, router);
 		return ups_router;
 	}
 
-	snprintf(path, sizeof(path), "readlink %s%s", tbt_sysfs_path, router);
-	output = do_bash_cmd(path);
+	len = readlinkat(get_tbt_sysfs_fd(), router, output, sizeof(output) - 1);
+	if (len <= 0)
+		return ups_router;
+
+	output[len] = '\0';
 
 	pos2 = strrchr(output, '/') - output;
 	pos1 = pos2 - 1;
@@ -113,11 +96,8 @@ static char* get_upstream_router(char *router)
 			break;
 	}
 
-	memset(ups_router, '\0', MAX_LEN * sizeof(char));
 	strncpy(ups_router, output + pos1 + 1, pos2 - pos1 - 1);
 
-	free(output);
-
 	return ups_router;
 }
 
@@ -1798,35 +1778,23 @@ static bool dump_router_verbose(char *router, u8 num)
 
 static bool dump_domain_verbose(u8 domain, char *depth, u8 num)
 {
-	struct list_item *router, *head;
-	char path[MAX_LEN];
+	struct tbt_topology *top = get_topology();
+	struct tbt_router *router;
 	bool found = false;
+	u64 i = 0;
 
-	snprintf(path, sizeof(path), "for line in $(ls %s); do echo $line; done",
-		 tbt_sysfs_path);
-
-	router = do_bash_cmd_list(path);
-	head = router;
+	for (; i < top->total_routers; i++) {
+		router = &top->routers[i];
 
-	if (depth) {
-		for(; router != NULL; router = router->next) {
-			if (!is_router_format((char*)router->val, domain))
-				continue;
+		if (router->domain != domain)
+			continue;
 
-			if (is_router_depth((char*)router->val, strtoud(depth)))
-				found |= dump_router_verbose((char*)router->val, num);
-		}
-	} else {
-		for(; router != NULL; router = router->next) {
-			if (!is_router_format((char*)router->val, domain))
-				continue;
+		if (depth && router->depth != strtoud(depth))
+			continue;
 
-			found |= dump_router_verbose((char*)router->val, num);
-		}
+		found |= dump_router_verbose(router->name, num);
 	}
 
-	free_list(head);
-
 	return found;
 }
 
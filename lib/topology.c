@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Topology snapshot of the TBT/USB4 subsystem
+ *
+ * This file reads the thunderbolt sysfs devices directory once and parses the
+ * routers and retimers present in it, so that the rest of the library can query
+ * the topology without listing the sysfs again.
+ *
+ * Copyright (C) 2023 Rajat Khandelwal <rajat.khandelwal@intel.com>
+ * Copyright (C) 2023 Intel Corporation
+ */
+
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "helpers.h"
+
+static struct tbt_topology *topology = NULL;
+
+/* Returns the no. of hops in the provided route string */
+static u8 route_depth(u64 route)
+{
+	u8 depth = 0;
+
+	for (; route; route >>= ROUTE_HOP_BITS)
+		depth++;
+
+	return depth;
+}
+
+/*
+ * Parses the router name in the format '<domain>-<route in hex>'.
+ * Returns a pointer to the first unparsed character on success, NULL otherwise.
+ */
+static const char* parse_router_name(const char *name, u8 *domain, u64 *route)
+{
+	char *end;
+
+	if (!isdigit(name[0]))
+		return NULL;
+
+	*domain = strtoul(name, &end, 10);
+	if (*end != '-' || !isxdigit(end[1]))
+		return NULL;
+
+	*route = strtoull(end + 1, &end, 16);
+
+	return end;
+}
+
+/*
+ * Parses the retimer name in the format '<router>:<port>.<index>'.
+ * Returns 'true' on success, 'false' otherwise.
+ */
+static bool parse_retimer_name(const char *name, struct tbt_retimer *retimer)
+{
+	const char *pos;
+	char *end;
+	u64 route;
+
+	pos = parse_router_name(name, &retimer->domain, &route);
+	if (!pos || *pos != ':' || !isdigit(pos[1]))
+		return false;
+
+	retimer->port = strtoul(pos + 1, &end, 10);
+	if (*end != '.' || !isdigit(end[1]))
+		return false;
+
+	retimer->index = strtoul(end + 1, &end, 10);
+
+	return *end == '\0';
+}
+
+static int cmp_router_name(const void *a, const void *b)
+{
+	return strcmp(((const struct tbt_router*)a)->name,
+		      ((const struct tbt_router*)b)->name);
+}
+
+static int cmp_retimer_name(const void *a, const void *b)
+{
+	return strcmp(((const struct tbt_retimer*)a)->name,
+		      ((const struct tbt_retimer*)b)->name);
+}
+
+static struct tbt_router* find_router_by_route(u8 domain, u64 route)
+{
+	char name[TBT_NAME_LEN];
+
+	snprintf(name, sizeof(name), "%u-%llx", domain, (unsigned long long)route);
+
+	return find_router(name);
+}
+
+/* Links the routers with their upstream routers, and retimers with their routers */
+static void link_topology(struct tbt_topology *top)
+{
+	struct tbt_router *router;
+	u64 parent_route, i;
+	char *pos;
+
+	/* Iterate in reverse so that the children lists remain in the sysfs order */
+	for (i = top->total_routers; i--;) {
+		router = &top->routers[i];
+
+		if (!router->depth)
+			continue;
+
+		parent_route = router->route & ~(BITMASK(ROUTE_HOP_BITS - 1, 0) <<
+				(ROUTE_HOP_BITS * (router->depth - 1)));
+
+		router->parent = find_router_by_route(router->domain, parent_route);
+		if (!router->parent)
+			continue;
+
+		router->sibling = router->parent->child;
+		router->parent->child = router;
+	}
+
+	for (i = 0; i < top->total_retimers; i++) {
+		char name[TBT_NAME_LEN];
+
+		strcpy(name, top->retimers[i].name);
+
+		pos = strchr(name, ':');
+		*pos = '\0';
+
+		top->retimers[i].router = find_router(name);
+	}
+}
+
+/* Reads the thunderbolt sysfs devices directory and builds the snapshot */
+static struct tbt_topology* build_topology(void)
+{
+	u64 routers_cap = 0, retimers_cap = 0;
+	struct tbt_topology *top;
+	struct dirent *entry;
+	const char *pos;
+	int fd;
+	DIR *dir;
+
+	top = calloc(1, sizeof(struct tbt_topology));
+
+	fd = get_tbt_sysfs_fd();
+	if (fd < 0)
+		return top;
+
+	/* 'closedir' closes the fd passed, hence keep the cached one open */
+	dir = fdopendir(dup(fd));
+	if (!dir)
+		return top;
+
+	while ((entry = readdir(dir))) {
+		struct tbt_retimer retimer = { 0 };
+		struct tbt_router router = { 0 };
+
+		if (strlen(entry->d_name) >= TBT_NAME_LEN)
+			continue;
+
+		if (!strncmp(entry->d_name, "domain", strlen("domain"))) {
+			top->domains++;
+			continue;
+		}
+
+		pos = parse_router_name(entry->d_name, &router.domain, &router.route);
+		if (pos && *pos == '\0') {
+			strcpy(router.name, entry->d_name);
+			router.depth = route_depth(router.route);
+
+			if (top->total_routers == routers_cap) {
+				routers_cap = routers_cap ? 2 * routers_cap : 16;
+				top->routers = realloc(top->routers, routers_cap *
+						       sizeof(struct tbt_router));
+			}
+
+			top->routers[top->total_routers++] = router;
+			continue;
+		}
+
+		if (parse_retimer_name(entry->d_name, &retimer)) {
+			strcpy(retimer.name, entry->d_name);
+
+			if (top->total_retimers == retimers_cap) {
+				retimers_cap = retimers_cap ? 2 * retimers_cap : 16;
+				top->retimers = realloc(top->retimers, retimers_cap *
+							sizeof(struct tbt_retimer));
+			}
+
+			top->retimers[top->total_retimers++] = retimer;
+		}
+	}
+
+	closedir(dir);
+
+	if (top->total_routers)
+		qsort(top->routers, top->total_routers, sizeof(struct tbt_router),
+		      cmp_router_name);
+
+	if (top->total_retimers)
+		qsort(top->retimers, top->total_retimers, sizeof(struct tbt_retimer),
+		      cmp_retimer_name);
+
+	return top;
+}
+
+/* Returns the topology snapshot, building it on the first call */
+struct tbt_topology* get_topology(void)
+{
+	if (topology)
+		return topology;
+
+	topology = build_topology();
+	link_topology(topology);
+
+	return topology;
+}
+
+/* Frees the topology snapshot */
+void free_topology(void)
+{
+	if (!topology)
+		return;
+
+	free(topology->routers);
+	free(topology->retimers);
+	free(topology);
+
+	topology = NULL;
+}
+
+/* Returns the router with the provided name, NULL if not present */
+struct tbt_router* find_router(const char *name)
+{
+	struct tbt_topology *top = get_topology();
+	struct tbt_router key;
+
+	if (!top->total_routers || strlen(name) >= TBT_NAME_LEN)
+		return NULL;
+
+	strcpy(key.name, name);
+
+	return bsearch(&key, top->routers, top->total_routers,
+		       sizeof(struct tbt_router), cmp_router_name);
+}
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Copyright (C) 2023 Rajat Khandelwal <rajat.khandelwal@intel.com>
+ * Copyright (C) 2023 Intel Corporation
+ */
+
+/* Max. length of a router/retimer name as present in the sysfs */
+#define TBT_NAME_LEN		32
+
+/* No. of bits in the route string reflecting one hop */
+#define ROUTE_HOP_BITS		8
+
+struct tbt_router {
+	char name[TBT_NAME_LEN];
+	u8 domain;
+	u8 depth;
+	u64 route;
+
+	/* Router connected to the upstream port, NULL for host routers */
+	struct tbt_router *parent;
+
+	/* Routers connected to the downstream ports, in the sysfs order */
+	struct tbt_router *child;
+	struct tbt_router *sibling;
+};
+
+struct tbt_retimer {
+	char name[TBT_NAME_LEN];
+	u8 domain;
+	u8 port;
+	u8 index;
+
+	/* Router the retimer is present in */
+	struct tbt_router *router;
+};
+
+/*
+ * Snapshot of the thunderbolt sysfs devices, read once per lstbt invocation.
+ * Both the arrays are sorted by the device name (like 'ls' does), which also
+ * serves as the index for the name lookups.
+ */
+struct tbt_topology {
+	u8 domains;
+
+	u64 total_routers;
+	struct tbt_router *routers;
+
+	u64 total_retimers;
+	struct tbt_retimer *retimers;
+};
+
+struct tbt_topology* get_topology(void);
+void free_topology(void);
+struct tbt_router* find_router(const char *name);
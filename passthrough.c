@@ -11,6 +11,7 @@
  * Copyright (C) 2023 Intel Corporation
  */
 
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -20,104 +21,118 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 
 #include "pciutils.h"
 
-#define TRIM_IOMMU_NUM_PATH	13
+#define VFIO_PCI_DRV		"vfio-pci"
 
-/* Binds the VFIO module to the provided PCI device */
-static void bind_vfio_module(const char *pci_id, const struct vdid *vdid)
+#define HUGE_PAGE_SIZE		(2 * 1024 * 1024)
+
+#define NO_IOMMU_PARAM		"/sys/module/vfio/parameters/enable_unsafe_noiommu_mode"
+
+/* Default period (ms) of the no-IOMMU watchdog */
+#define NO_IOMMU_CHECK_MS	100
+
+/* IOVA space managed by the allocator of a container */
+#define IOVA_SPACE_SIZE		(256ULL * 1024 * 1024)
+
+/* No-IOMMU mode parameter, kept open for the watchdog, and the watchdog's period */
+static int no_iommu_fd = -1;
+static u32 no_iommu_check_ms = NO_IOMMU_CHECK_MS;
+
+/*
+ * IOMMU groups bound to VFIO, with the no. of users of each. A group is bound by its
+ * first user and unbound by its last one, and all the binding, unbinding and the
+ * rescans are serialized, since they act on the whole group (or bus).
+ */
+struct bound_grp {
+	char *grp;
+	u32 users;
+	struct bound_grp *next;
+};
+
+static struct bound_grp *bound_grps;
+static pthread_mutex_t bound_grps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Unbinds the provided PCI device from its driver, if any */
+static int unbind_pci_drv(int dir_fd, const char *pci_id)
 {
-	char drv_path[3 * MAX_LEN];
-	char *root_cmd, *bash_op;
-	char dev_path[MAX_LEN];
-	char check[MAX_LEN];
+	if (faccessat(dir_fd, "driver", F_OK, AT_SYMLINK_NOFOLLOW))
+		return 0;
 
-	snprintf(check, sizeof(check), "%s%s/driver/unbind", pci_dev_sysfs_path, pci_id);
-	if (is_link_nabs(check))
-		exit(1);
+	return write_sysfs_attr(dir_fd, "driver/unbind", pci_id);
+}
 
-	snprintf(dev_path, sizeof(dev_path), "echo %s > %s%s/driver/unbind",
-		 pci_id, pci_dev_sysfs_path, pci_id);
-	root_cmd = switch_cmd_to_root(dev_path);
-	bash_op = do_bash_cmd(root_cmd);
+/*
+ * Binds the VFIO module to the provided PCI device. The driver override makes sure
+ * that only VFIO can claim the device, without adding its IDs to VFIO (which would
+ * claim all the other devices with the same IDs as well).
+ */
+static int bind_vfio_module(const char *pci_id)
+{
+	int dir_fd = open_pci_dev_dir(pci_id);
+	char path[MAX_LEN];
+	int ret;
 
-	free(root_cmd);
-	free(bash_op);
+	if (dir_fd < 0)
+		return ENODEV;
 
-	memset(check, '\0', MAX_LEN);
-	snprintf(check, sizeof(check), "%svfio-pci/new_id", pci_drv_sysfs_path);
-	if (is_link_nabs(check))
-		exit(1);
+	ret = write_sysfs_attr(dir_fd, "driver_override", VFIO_PCI_DRV);
+	if (!ret)
+		ret = unbind_pci_drv(dir_fd, pci_id);
 
-	snprintf(drv_path, sizeof(drv_path), "echo '%s %s' > %svfio-pci/new_id",
-		 vdid->vendor_id, vdid->device_id, pci_drv_sysfs_path);
-	root_cmd = switch_cmd_to_root(drv_path);
-	bash_op = do_bash_cmd(root_cmd);
+	close(dir_fd);
 
-	free(root_cmd);
-	free(bash_op);
+	if (ret)
+		return ret;
+
+	snprintf(path, sizeof(path), "%s%s/bind", pci_drv_sysfs_path, VFIO_PCI_DRV);
+
+	return write_sysfs_attr(AT_FDCWD, path, pci_id);
 }
 
 /* Unbinds the VFIO module from the provided PCI device and removes it */
-static void unbind_vfio_module(const char *pci_id, const struct vdid *vdid)
+static int unbind_vfio_module(const char *pci_id)
 {
-	char drv_path[3 * MAX_LEN];
-	char *root_cmd, *bash_op;
-	char dev_path[MAX_LEN];
-	char check[MAX_LEN];
-
-	snprintf(check, sizeof(check), "%s%s/driver/unbind", pci_dev_sysfs_path, pci_id);
-	if (is_link_nabs(check))
-		exit(1);
+	int dir_fd = open_pci_dev_dir(pci_id);
+	int ret;
 
-	snprintf(dev_path, sizeof(dev_path), "echo %s > %s%s/driver/unbind",
-		 pci_id, pci_dev_sysfs_path, pci_id);
-	root_cmd = switch_cmd_to_root(dev_path);
-	bash_op = do_bash_cmd(root_cmd);
+	if (dir_fd < 0)
+		return ENODEV;
 
-	free(root_cmd);
-	free(bash_op);
+	ret = unbind_pci_drv(dir_fd, pci_id);
 
-	memset(check, '\0', MAX_LEN);
-	snprintf(check, sizeof(check), "%svfio-pci/remove_id", pci_drv_sysfs_path);
-	if (is_link_nabs(check))
-		exit(1);
+	/* An empty override lets the device's own driver claim it on the rescan */
+	if (!ret)
+		ret = write_sysfs_attr(dir_fd, "driver_override", "\n");
 
-	snprintf(drv_path, sizeof(drv_path), "echo '%s %s' > %svfio-pci/remove_id",
-		 vdid->vendor_id, vdid->device_id, pci_drv_sysfs_path);
-	root_cmd = switch_cmd_to_root(drv_path);
-	bash_op = do_bash_cmd(root_cmd);
+	close(dir_fd);
 
 	remove_pci_dev(pci_id);
 
-	free(root_cmd);
-	free(bash_op);
+	return ret;
 }
 
 /* Returns the IOMMU group number of the provided PCI device */
 static char* find_iommu_grp(const char *pci_id)
 {
-	char *iommu_grp = malloc(MAX_LEN * sizeof(char));
-	char path[MAX_LEN];
-	char *bash_result;
-	u16 pos, len_str;
+	char path[MAX_LEN], link[MAX_LEN];
+	char *grp;
+	ssize_t len;
 
-	snprintf(path, sizeof(path), "readlink %s%s/iommu_group", pci_dev_sysfs_path,
-		 pci_id);
+	snprintf(path, sizeof(path), "%s%s/iommu_group", pci_dev_sysfs_path, pci_id);
 
-	bash_result = do_bash_cmd(path);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len < 0)
+		return strdup("");
 
-	pos = strpos(bash_result, "iommu_group", 0);
-	len_str = strlen(bash_result + pos + TRIM_IOMMU_NUM_PATH);
+	link[len] = '\0';
 
-	strncpy(iommu_grp, bash_result + pos + TRIM_IOMMU_NUM_PATH, len_str);
-	iommu_grp[len_str] = '\0';
+	grp = strrchr(link, '/');
 
-	free(bash_result);
-
-	return trim_white_space(iommu_grp);
+	return strdup(grp ? grp + 1 : link);
 }
 
 static bool is_vfio_bar_index(u8 index)
@@ -140,146 +155,288 @@ static bool is_region_mmap(struct vfio_region_info *reg_info)
 	return reg_info->flags & VFIO_REGION_INFO_FLAG_MMAP;
 }
 
+/*
+ * Returns the BAR mapping housing 'dwords' consecutive dwords starting at the given
+ * offset, or NULL if the range is not fully contained in a single region.
+ */
+static struct bar_map* find_bar_map_for_range(const struct vfio_hlvl_params *params,
+					      u64 off, u64 dwords)
+{
+	struct bar_map *map = find_bar_map_for_off(params, off);
+
+	if (!map || !dwords || (off + dwords * sizeof(u32) > map->end))
+		return NULL;
+
+	return map;
+}
+
 /* Returns one dword from the host interface config. space at the given offset */
 static u32 read_host_mem(const struct vfio_hlvl_params *params, u64 off)
 {
-	struct vfio_region_info *reg_info = find_bar_for_off(params->bar_regions, off);
-	struct list_item *temp = params->bar_regions;
-	struct vfio_region_info *temp_reg;
-	u64 prev_size = 0;
-	void *user_va;
-	u32 mem;
+	volatile u32 *ptr = host_mem_ptr(params, off);
+	u32 val;
+
+	if (ptr)
+		return *ptr;
 
-	if (!is_region_mmap(reg_info))
+	/* Region doesn't support mmap, go via the device fd instead */
+	if (read_host_mem_block(params, off, &val, 1))
 		return ~0;
 
-	while (temp->val != reg_info) {
-		temp_reg = (struct vfio_region_info*)(temp->val);
-		prev_size += temp_reg->size;
+	return val;
+}
 
-		temp = temp->next;
-	}
+/*
+ * Returns 'true' if the VFIO is in no-IOMMU mode. The parameter is re-read via the fd
+ * kept open, else opened afresh in case it didn't exist at the start.
+ */
+static bool is_vfio_no_iommu(void)
+{
+	int fd = no_iommu_fd;
+	char val = 'N';
 
-	user_va = get_user_mapped_read_va(params->device, reg_info->offset, reg_info->size);
+	if (fd < 0)
+		fd = open(NO_IOMMU_PARAM, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
 
-	mem = *(u32*)(user_va + (off - prev_size));
+	if (pread(fd, &val, sizeof(val), 0) != sizeof(val))
+		val = 'N';
 
-	unmap_user_mapped_va(user_va, reg_info->size);
+	if (fd != no_iommu_fd)
+		close(fd);
 
-	return mem;
+	return val == 'Y';
 }
 
-/* Not usable for now */
-/*static struct vfio_iommu_type1_info* get_iommu_info(int container)
+/*
+ * Terminates all the threads if the VFIO is in no-IOMMU mode, and doesn't allow the
+ * user (or attacker) to proceed with anything. Called by the watchdog periodically,
+ * and before every DMA setup so that none is done past a mode switch.
+ */
+void check_vfio_no_iommu(void)
 {
-	struct vfio_iommu_type1_info *info = malloc(sizeof(struct vfio_iommu_type1_info));
-
-	info->argsz = sizeof(struct vfio_iommu_type1_info);
-
-	ioctl(container, VFIO_IOMMU_GET_INFO, info);
+	if (is_vfio_no_iommu()) {
+		fprintf(stderr, "no-IOMMU enabled VFIO detected... aborting!\n");
+		exit(1);
+	}
+}
 
-	return info;
-}*/
+/* Sets the period (ms) of the no-IOMMU watchdog, 0 restores the default */
+void set_no_iommu_check_interval(u32 interval_ms)
+{
+	__atomic_store_n(&no_iommu_check_ms, interval_ms ? interval_ms : NO_IOMMU_CHECK_MS,
+			 __ATOMIC_RELAXED);
+}
 
 /*
  * Function to run in a separate thread to check if the VFIO is enabled in no-IOMMU
- * mode. If yes, terminate all the threads and don't allow the user (or attacker) to
- * proceed with anything.
+ * mode. A single 'pread' of the parameter per period keeps it close to zero CPU.
  */
 void* wait_for_vfio_no_iommu(void* arg)
 {
-	char *cmd = "cat /sys/module/vfio/parameters/enable_unsafe_noiommu_mode";
-	char *result;
-
 	if (arg) {
 		fprintf(stderr, "inconsistencies detected... aborting!\n");
 		exit(1);
 	}
 
 	while (1) {
-		result = do_bash_cmd(cmd);
-		if (result && (result[0] == 'Y')) {
-			fprintf(stderr, "no-IOMMU enabled VFIO detected... aborting!\n");
-			free(result);
-
-			exit(1);
-		} else if (result)
-			free(result);
+		check_vfio_no_iommu();
+		msleep(__atomic_load_n(&no_iommu_check_ms, __ATOMIC_RELAXED));
 	}
 }
 
+/*
+ * Checks if the VFIO PCI driver is present, loading it if not yet, and starts the
+ * no-IOMMU watchdog.
+ */
 bool check_vfio_module(void)
 {
 	char *cmd = "modprobe 2>/dev/null vfio-pci; echo $?";
 	pthread_t vfio_no_iommu;
+	char path[MAX_LEN];
 	char *present;
 	bool pres;
 	int ret;
 
-	present = do_bash_cmd(cmd);
+	/* Only shell out to load the module if it isn't already */
+	snprintf(path, sizeof(path), "%s%s", pci_drv_sysfs_path, VFIO_PCI_DRV);
+	if (access(path, F_OK)) {
+		present = do_bash_cmd(cmd);
+		pres = !strtoud(present);
 
-	pres = !strtoud(present);
-	if (!pres) {
 		free(present);
-		return false;
+
+		if (!pres)
+			return false;
 	}
 
+	/* Opened once here, before the watchdog (and any other user) starts */
+	if (no_iommu_fd < 0)
+		no_iommu_fd = open(NO_IOMMU_PARAM, O_RDONLY | O_CLOEXEC);
+
+	check_vfio_no_iommu();
+
 	ret = pthread_create(&vfio_no_iommu, NULL, wait_for_vfio_no_iommu, NULL);
 	if (ret)
 		printf("WARN: no-IOMMU VFIO mode is not being checked!\n");
 
-	free(present);
-
 	return true;
 }
 
+/* Binding (or unbinding) of a module, run in its own thread */
+struct grp_module_work {
+	int (*fn)(const char *pci_id);
+	const char *pci_id;
+	int ret;
+};
+
+static void* do_grp_module_work(void *arg)
+{
+	struct grp_module_work *work = arg;
+
+	work->ret = work->fn(work->pci_id);
+
+	return NULL;
+}
+
+/*
+ * Runs 'fn' on all the given modules in parallel, so that the time taken is that of
+ * the slowest driver (un)binding, not the sum of all.
+ */
+static void run_on_grp_modules(const struct pci_vdid *dev_list, u64 num,
+			       int (*fn)(const char *pci_id), const char *op)
+{
+	struct grp_module_work *works = calloc(num, sizeof(struct grp_module_work));
+	pthread_t *threads = calloc(num, sizeof(pthread_t));
+	bool *started = calloc(num, sizeof(bool));
+	u64 i = 0;
+
+	for (; i < num; i++) {
+		works[i].fn = fn;
+		works[i].pci_id = dev_list[i].pci_id;
+
+		started[i] = !pthread_create(&threads[i], NULL, do_grp_module_work, &works[i]);
+		if (!started[i])
+			do_grp_module_work(&works[i]);
+	}
+
+	for (i = 0; i < num; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+
+		if (works[i].ret)
+			fprintf(stderr, "failed to %s %s: %s\n", op, dev_list[i].pci_id,
+				strerror(works[i].ret));
+	}
+
+	free(started);
+	free(threads);
+	free(works);
+}
+
+/* Returns the link of the given IOMMU group in 'bound_grps' */
+static struct bound_grp** find_bound_grp(const char *grp)
+{
+	struct bound_grp **pos = &bound_grps;
+
+	while (*pos && strcmp((*pos)->grp, grp))
+		pos = &(*pos)->next;
+
+	return pos;
+}
+
 /*
  * Binds VFIO to all the modules present in the IOMMU group of the given PCI device and
- * returns the list of all the such modules.
+ * returns the list of all the such modules, their count being stored in 'num'.
+ * A group already bound for another device is only taken another reference of, so that
+ * a caller failing later on (e.g., the VFIO group being already open) doesn't unbind a
+ * group still in use.
  */
-struct pci_vdid* bind_grp_modules(const char *pci_id)
+struct pci_vdid* bind_grp_modules(const char *pci_id, u64 *num)
 {
-	struct list_item *list_modules, *head;
 	struct pci_vdid *dev_list;
-	char path[MAX_LEN];
+	struct bound_grp **pos;
+	char *grp, **ids;
 	u64 i = 0;
 
-	snprintf(path, sizeof(path), "for line in $(ls %s%s/iommu_group/devices); do echo $line; done",
-		 pci_dev_sysfs_path, pci_id);
+	pthread_mutex_lock(&bound_grps_lock);
 
-	list_modules = do_bash_cmd_list(path);
-	head = list_modules;
+	grp = find_iommu_grp(pci_id);
+	ids = get_grp_modules(pci_id, num);
 
-	dev_list = malloc(get_total_list_items(list_modules) * sizeof(struct pci_vdid));
+	dev_list = malloc(*num * sizeof(struct pci_vdid));
 
-	for (; list_modules != NULL; list_modules = list_modules->next) {
-		dev_list[i].pci_id = malloc(MAX_LEN * sizeof(char));
-		strcpy(dev_list[i].pci_id, (char*)list_modules->val);
+	for (; i < *num; i++) {
+		dev_list[i].pci_id = ids[i];
+		dev_list[i].vdid = get_vdid(ids[i]);
+	}
+
+	free(ids);
 
-		dev_list[i].vdid = get_vdid(list_modules->val);
+	pos = find_bound_grp(grp);
+	if (*pos) {
+		(*pos)->users++;
+		free(grp);
+	} else if (*num) {
+		run_on_grp_modules(dev_list, *num, bind_vfio_module, "bind VFIO to");
 
-		bind_vfio_module((char*)list_modules->val, dev_list[i++].vdid);
+		*pos = calloc(1, sizeof(struct bound_grp));
+		(*pos)->grp = grp;
+		(*pos)->users = 1;
+	} else {
+		free(grp);
 	}
 
-	free_list(head);
+	pthread_mutex_unlock(&bound_grps_lock);
 
 	return dev_list;
 }
 
-/* Unbinds VFIO to all the PCI modules present in the 'dev_list' provided */
+/*
+ * Drops the reference to the IOMMU group of the given modules, as returned by
+ * 'bind_grp_modules'. The last user unbinds VFIO from them, removes them and rescans
+ * the bus so that their own drivers claim them back.
+ */
 void unbind_grp_modules(struct pci_vdid *dev_list, u64 num)
 {
+	struct bound_grp **pos, *bound = NULL;
 	u64 i = 0;
+	char *grp;
+
+	pthread_mutex_lock(&bound_grps_lock);
+
+	if (num) {
+		grp = find_iommu_grp(dev_list[0].pci_id);
+		pos = find_bound_grp(grp);
+		free(grp);
+
+		if (*pos && --(*pos)->users)
+			goto out;
+
+		if (*pos) {
+			bound = *pos;
+			*pos = bound->next;
+		}
+	}
+
+	run_on_grp_modules(dev_list, num, unbind_vfio_module, "unbind VFIO from");
+	do_pci_rescan();
+
+	if (bound) {
+		free(bound->grp);
+		free(bound);
+	}
+
+out:
+	pthread_mutex_unlock(&bound_grps_lock);
 
 	for (; i < num; i++) {
-		unbind_vfio_module(dev_list[i].pci_id, dev_list[i].vdid);
 		free(dev_list[i].pci_id);
 		free(dev_list[i].vdid);
 	}
 
 	free(dev_list);
-
-	do_pci_rescan();
 }
 
 /* Initialize the VFIO for the given PCI ID */
@@ -289,9 +446,12 @@ struct vfio_hlvl_params* vfio_dev_init(const char *pci_id)
 	struct vfio_device_info device_info = { .argsz = sizeof(device_info) };
 	struct vfio_hlvl_params *params;
 	int container, group, device;
+	struct iommu_info iommu;
 	char path[MAX_LEN];
 	char *iommu_grp;
 
+	check_vfio_no_iommu();
+
 	container = open("/dev/vfio/vfio", O_RDWR);
 	if (ioctl(container, VFIO_GET_API_VERSION) != VFIO_API_VERSION) {
 		fprintf(stderr, "unknown API version\n");
@@ -315,6 +475,16 @@ struct vfio_hlvl_params* vfio_dev_init(const char *pci_id)
 	snprintf(path, sizeof(path), "/dev/vfio/%s", iommu_grp);
 
 	group = open(path, O_RDWR);
+	if (group < 0) {
+		/* EBUSY if the group is already open, e.g., for another controller */
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+
+		free(iommu_grp);
+		close(container);
+
+		return NULL;
+	}
+
 	ioctl(group, VFIO_GROUP_GET_STATUS, &group_status);
 
 	if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
@@ -335,13 +505,25 @@ struct vfio_hlvl_params* vfio_dev_init(const char *pci_id)
 
 	ioctl(container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU);
 
+	if (get_iommu_info(container, &iommu)) {
+		fprintf(stderr, "failed to fetch the IOMMU info\n");
+
+		free(iommu_grp);
+		close(group);
+		close(container);
+
+		return NULL;
+	}
+
 	device = ioctl(group, VFIO_GROUP_GET_DEVICE_FD, pci_id);
 	ioctl(device, VFIO_DEVICE_GET_INFO, &device_info);
 
-	params = malloc(sizeof(struct vfio_hlvl_params));
+	params = calloc(1, sizeof(struct vfio_hlvl_params));
 	params->container = container;
 	params->group = group;
 	params->device = device;
+	params->iommu = iommu;
+	params->iova = iova_allocator_create(&params->iommu);
 
 	params->dev_info = malloc(sizeof(struct vfio_device_info));
 	*params->dev_info = device_info;
@@ -351,16 +533,22 @@ struct vfio_hlvl_params* vfio_dev_init(const char *pci_id)
 	return params;
 }
 
-/* Returns the BAR regions of the given PCI device */
+/*
+ * Returns the BAR regions of the given PCI device.
+ * The regions supporting mmap are mapped once here and stay mapped until
+ * 'free_dev_bar_regions', so that the host memory accesses don't need to map them.
+ */
 void get_dev_bar_regions(struct vfio_hlvl_params *params)
 {
-	struct list_item *temp = NULL;
+	u64 start = 0;
 	u8 i = 0;
 
-	params->bar_regions = NULL;
+	params->bar_maps = calloc(VFIO_PCI_NUM_REGIONS, sizeof(struct bar_map));
+	params->total_bars = 0;
 
 	for (i = 0; i < VFIO_PCI_NUM_REGIONS; i++) {
 		struct vfio_region_info *region_info = malloc(sizeof(struct vfio_region_info));
+		struct bar_map *map;
 
 		region_info->argsz = sizeof(*region_info);
 
@@ -377,11 +565,41 @@ void get_dev_bar_regions(struct vfio_hlvl_params *params)
 			continue;
 		}
 
-		temp = list_add(temp, (void*)region_info);
+		/* Regions are visited in the index order, hence the array stays sorted */
+		map = &params->bar_maps[params->total_bars++];
+		map->start = start;
+		map->end = start + region_info->size;
+		map->region_info = region_info;
+		map->va = NULL;
+
+		if (is_region_mmap(region_info)) {
+			map->va = get_user_mapped_rw_va(params->device, region_info->offset,
+							region_info->size);
+			if (map->va == MAP_FAILED)
+				map->va = NULL;
+		}
+
+		start = map->end;
+	}
+}
+
+/* Unmaps and frees the BAR regions fetched via 'get_dev_bar_regions' */
+void free_dev_bar_regions(struct vfio_hlvl_params *params)
+{
+	u8 i = 0;
+
+	for (; i < params->total_bars; i++) {
+		if (params->bar_maps[i].va)
+			unmap_user_mapped_va(params->bar_maps[i].va,
+					     params->bar_maps[i].region_info->size);
 
-		if (!params->bar_regions)
-			params->bar_regions = temp;
+		free(params->bar_maps[i].region_info);
 	}
+
+	free(params->bar_maps);
+
+	params->bar_maps = NULL;
+	params->total_bars = 0;
 }
 
 /* Returns the PCI config. space region of the given PCI device */
@@ -410,31 +628,35 @@ void get_dev_pci_cfg_region(struct vfio_hlvl_params *params)
 	}
 }
 
-/* Returns the BAR region number for the given offset */
-struct vfio_region_info* find_bar_for_off(struct list_item *bar_regions, u64 off)
+/*
+ * Returns the mapping of the BAR region housing the given offset.
+ * The no. of regions ending at or before the offset is the index of the region
+ * housing it, which avoids the data-dependent branches in the lookup.
+ */
+struct bar_map* find_bar_map_for_off(const struct vfio_hlvl_params *params, u64 off)
 {
-	struct list_item *temp = bar_regions;
-	struct vfio_region_info reg_info;
-	u64 temp_size = 0;
+	u8 i = 0, index = 0;
 
-	while (temp) {
-		reg_info = *(struct vfio_region_info*)(temp->val);
+	for (; i < params->total_bars; i++)
+		index += off >= params->bar_maps[i].end;
 
-		temp_size += reg_info.size;
-		if (temp_size <= off) {
-			temp = temp->next;
-			continue;
-		}
-
-		break;
-	}
-
-	if (!temp) {
+	if (index >= params->total_bars) {
 		fprintf(stderr, "offset:0x%" PRIx64 " out of bounds\n", off);
 		return NULL;
 	}
 
-	return (struct vfio_region_info*)(temp->val);
+	return &params->bar_maps[index];
+}
+
+/* Returns the BAR region for the given offset */
+struct vfio_region_info* find_bar_for_off(const struct vfio_hlvl_params *params, u64 off)
+{
+	struct bar_map *map = find_bar_map_for_off(params, off);
+
+	if (!map)
+		return NULL;
+
+	return map->region_info;
 }
 
 u32 read_host_mem_long(const struct vfio_hlvl_params *params, u64 off)
@@ -455,62 +677,234 @@ u8 read_host_mem_byte(const struct vfio_hlvl_params *params, u64 off)
 /* Writes a dword to the host interface config. space at the given offset */
 void write_host_mem(const struct vfio_hlvl_params *params, u64 off, u32 value)
 {
-	struct vfio_region_info *reg_info = find_bar_for_off(params->bar_regions, off);
-	struct list_item *temp = params->bar_regions;
-	struct vfio_region_info *temp_reg;
-	u64 prev_size = 0;
-	void *user_va;
+	volatile u32 *ptr = host_mem_ptr(params, off);
 
-	if (!is_region_mmap(reg_info))
+	if (ptr) {
+		*ptr = value;
 		return;
+	}
+
+	/* Region doesn't support mmap, go via the device fd instead */
+	write_host_mem_block(params, off, &value, 1);
+}
+
+/*
+ * Reads 'dwords' consecutive dwords from the host interface config. space at the
+ * given offset into 'buf'.
+ * Mapped regions are read dword by dword (as the registers expect), while the
+ * regions not supporting mmap are read via a single 'pread' on the device fd.
+ *
+ * Return: 0 on success, ERANGE if the range doesn't fit in a single region, and
+ * EIO if the device fd couldn't be read.
+ */
+int read_host_mem_block(const struct vfio_hlvl_params *params, u64 off, u32 *buf,
+			u64 dwords)
+{
+	struct bar_map *map = find_bar_map_for_range(params, off, dwords);
+	volatile u32 *ptr;
+	ssize_t len;
+	u64 i = 0;
+
+	if (!map)
+		return ERANGE;
+
+	if (map->va) {
+		ptr = (volatile u32*)(map->va + (off - map->start));
 
-	while (temp->val != reg_info) {
-		temp_reg = (struct vfio_region_info*)(temp->val);
-		prev_size += temp_reg->size;
+		for (; i < dwords; i++)
+			buf[i] = ptr[i];
 
-		temp = temp->next;
+		return 0;
 	}
 
-	user_va = get_user_mapped_write_va(params->device, reg_info->offset, reg_info->size);
-	*(u32*)(user_va + (off - prev_size)) = value;
+	len = pread(params->device, buf, dwords * sizeof(u32),
+		    map->region_info->offset + (off - map->start));
+	if (len != (ssize_t)(dwords * sizeof(u32)))
+		return EIO;
 
-	unmap_user_mapped_va(user_va, reg_info->size);
+	return 0;
 }
 
 /*
- * Prepare a VFIO DMA mapping for the given container.
+ * Writes 'dwords' consecutive dwords from 'buf' to the host interface config.
+ * space at the given offset.
+ * Mapped regions are written dword by dword, while the regions not supporting mmap
+ * are written via a single 'pwrite' on the device fd.
+ *
+ * Return: 0 on success, ERANGE if the range doesn't fit in a single region, and
+ * EIO if the device fd couldn't be written.
+ */
+int write_host_mem_block(const struct vfio_hlvl_params *params, u64 off,
+			 const u32 *buf, u64 dwords)
+{
+	struct bar_map *map = find_bar_map_for_range(params, off, dwords);
+	volatile u32 *ptr;
+	ssize_t len;
+	u64 i = 0;
+
+	if (!map)
+		return ERANGE;
+
+	if (map->va) {
+		ptr = (volatile u32*)(map->va + (off - map->start));
+
+		for (; i < dwords; i++)
+			ptr[i] = buf[i];
+
+		return 0;
+	}
+
+	len = pwrite(params->device, buf, dwords * sizeof(u32),
+		     map->region_info->offset + (off - map->start));
+	if (len != (ssize_t)(dwords * sizeof(u32)))
+		return EIO;
+
+	return 0;
+}
+
+/*
+ * Enables up to 'num' MSI-X vectors of the device (MSI if the device lacks MSI-X),
+ * each signalling its own eventfd in 'params->irq_fds'.
+ * Returns 0 on success, with 'params->total_irqs' holding the no. of vectors enabled.
+ */
+int enable_dev_irqs(struct vfio_hlvl_params *params, u32 num)
+{
+	struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
+	struct vfio_irq_set *irq_set;
+	int ret = 0;
+	u32 i = 0;
+
+	irq_info.index = VFIO_PCI_MSIX_IRQ_INDEX;
+	if (ioctl(params->device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info) || !irq_info.count) {
+		irq_info.index = VFIO_PCI_MSI_IRQ_INDEX;
+
+		if (ioctl(params->device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info) ||
+		    !irq_info.count)
+			return ENODEV;
+	}
+
+	if (!(irq_info.flags & VFIO_IRQ_INFO_EVENTFD))
+		return ENOTSUP;
+
+	if (num > irq_info.count)
+		num = irq_info.count;
+
+	irq_set = malloc(sizeof(struct vfio_irq_set) + num * sizeof(s32));
+	irq_set->argsz = sizeof(struct vfio_irq_set) + num * sizeof(s32);
+	irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER;
+	irq_set->index = irq_info.index;
+	irq_set->start = 0;
+	irq_set->count = num;
+
+	params->irq_fds = malloc(num * sizeof(int));
+
+	for (; i < num; i++) {
+		params->irq_fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (params->irq_fds[i] < 0) {
+			ret = errno;
+			goto err;
+		}
+	}
+
+	memcpy(irq_set->data, params->irq_fds, num * sizeof(s32));
+
+	if (ioctl(params->device, VFIO_DEVICE_SET_IRQS, irq_set)) {
+		ret = errno;
+		goto err;
+	}
+
+	params->total_irqs = num;
+	params->irq_index = irq_info.index;
+
+	free(irq_set);
+
+	return 0;
+
+err:
+	while (i--)
+		close(params->irq_fds[i]);
+
+	free(params->irq_fds);
+	params->irq_fds = NULL;
+
+	free(irq_set);
+
+	return ret;
+}
+
+/* Disables the vectors enabled via 'enable_dev_irqs' and closes their eventfds */
+void disable_dev_irqs(struct vfio_hlvl_params *params)
+{
+	struct vfio_irq_set irq_set = { .argsz = sizeof(irq_set) };
+	u32 i = 0;
+
+	if (!params->total_irqs)
+		return;
+
+	irq_set.flags = VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_TRIGGER;
+	irq_set.index = params->irq_index;
+	irq_set.start = 0;
+	irq_set.count = 0;
+
+	ioctl(params->device, VFIO_DEVICE_SET_IRQS, &irq_set);
+
+	for (; i < params->total_irqs; i++)
+		close(params->irq_fds[i]);
+
+	free(params->irq_fds);
+
+	params->irq_fds = NULL;
+	params->total_irqs = 0;
+}
+
+/*
+ * Prepare a VFIO DMA mapping for the given container, at an IOVA handed out by the
+ * container's IOVA allocator.
  *
  * Note: Since all the storage classes for thunderbolt hardware are less than page
  * size and aligment requirement for the mapping is in multiples of page size, prepare
  * the mapping for a whole page, and not for a specific size for ease.
  */
-struct vfio_iommu_type1_dma_map* iommu_map_va(int container, u8 op_flags, u8 index)
+struct vfio_iommu_type1_dma_map* iommu_map_va(const struct vfio_hlvl_params *params,
+					       u8 op_flags)
 {
-	struct vfio_iommu_type1_info info = { .argsz = sizeof(info) };
 	struct vfio_iommu_type1_dma_map *dma_map;
-	u64 pgsize_sup;
+	u64 pgsize_sup = params->iommu.pgsize;
+	u64 iova;
+
+	check_vfio_no_iommu();
+
+	iova = iova_alloc(params->iova, pgsize_sup, pgsize_sup);
+	if (iova == IOVA_INVALID)
+		return NULL;
 
 	dma_map = malloc(sizeof(struct vfio_iommu_type1_dma_map));
 	dma_map->argsz = sizeof(struct vfio_iommu_type1_dma_map);
 
-	ioctl(container, VFIO_IOMMU_GET_INFO, &info);
-	pgsize_sup = get_size_least_set(info.iova_pgsizes);
-
 	if (op_flags == READ_FLAG) {
 		dma_map->vaddr = (u64)get_user_mapped_read_va(-1, 0, pgsize_sup);
 		dma_map->flags = VFIO_DMA_MAP_FLAG_READ;
 	} else if (op_flags == WRITE_FLAG) {
 		dma_map->vaddr = (u64)get_user_mapped_write_va(-1, 0, pgsize_sup);
 		dma_map->flags = VFIO_DMA_MAP_FLAG_WRITE;
-	} else if (op_flags == RDWR_FLAG) {
+	} else {
 		dma_map->vaddr = (u64)get_user_mapped_rw_va(-1, 0, pgsize_sup);
 		dma_map->flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
 	}
 
-	dma_map->iova = index * pgsize_sup;
+	dma_map->iova = iova;
 	dma_map->size = pgsize_sup;
 
-	ioctl(container, VFIO_IOMMU_MAP_DMA, dma_map);
+	if (((void*)dma_map->vaddr == MAP_FAILED) ||
+	    ioctl(params->container, VFIO_IOMMU_MAP_DMA, dma_map)) {
+		if ((void*)dma_map->vaddr != MAP_FAILED)
+			munmap((void*)dma_map->vaddr, pgsize_sup);
+
+		iova_free(params->iova, iova, pgsize_sup);
+		free(dma_map);
+
+		return NULL;
+	}
 
 	return dma_map;
 }
@@ -530,17 +924,356 @@ void iommu_unmap_va(int container, struct vfio_iommu_type1_dma_map *dma_map)
  * Frees the DMA buffers and mappings:
  * 1. Free the virtual address of the buffer
  * 2. Unmap the DMA mapping to the 'iova'
- * 3. Free the VFIO DMA structure
+ * 3. Return the 'iova' to the allocator
+ * 4. Free the VFIO DMA structure
  */
-void free_dma_map(int container, struct vfio_iommu_type1_dma_map *dma_map)
+void free_dma_map(const struct vfio_hlvl_params *params,
+		  struct vfio_iommu_type1_dma_map *dma_map)
 {
-	struct vfio_iommu_type1_info info = { .argsz = sizeof(info) };
-	u64 pgsize_sup;
-
-	ioctl(container, VFIO_IOMMU_GET_INFO, &info);
-	pgsize_sup = get_size_least_set(info.iova_pgsizes);
+	if (!dma_map)
+		return;
 
-	munmap((void*)dma_map->vaddr, pgsize_sup);
-	iommu_unmap_va(container, dma_map);
+	munmap((void*)dma_map->vaddr, dma_map->size);
+	iommu_unmap_va(params->container, dma_map);
+	iova_free(params->iova, dma_map->iova, dma_map->size);
 	free(dma_map);
 }
+
+/*
+ * Creates a DMA arena of (at least) the given size, mapped with read/write access in
+ * a single IOMMU mapping.
+ * Huge pages are used if the size is big enough, the IOMMU supports them and the
+ * system has them reserved, so that the rings and buffers share one IOTLB entry.
+ * Otherwise, fall back to the regular pages.
+ */
+struct dma_arena* dma_arena_create(const struct vfio_hlvl_params *params, u64 size)
+{
+	u64 pgsize_sup = params->iommu.pgsize;
+	struct dma_arena *arena;
+	u64 align = pgsize_sup;
+	void *va = NULL;
+
+	check_vfio_no_iommu();
+
+	arena = calloc(1, sizeof(struct dma_arena));
+
+	if ((size >= HUGE_PAGE_SIZE) && (params->iommu.pgsizes & HUGE_PAGE_SIZE)) {
+		size = GET_ALIGNED_PAGE(size, HUGE_PAGE_SIZE);
+
+		va = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		arena->huge = va != MAP_FAILED;
+	}
+
+	if (arena->huge)
+		align = HUGE_PAGE_SIZE;
+	else {
+		size = GET_ALIGNED_PAGE(size, pgsize_sup);
+
+		va = get_user_mapped_rw_va(-1, 0, size);
+		if (va == MAP_FAILED) {
+			free(arena);
+			return NULL;
+		}
+	}
+
+	arena->dma_map.argsz = sizeof(struct vfio_iommu_type1_dma_map);
+	arena->dma_map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
+	arena->dma_map.vaddr = (u64)va;
+	arena->dma_map.size = size;
+
+	arena->dma_map.iova = iova_alloc(params->iova, size, align);
+	if (arena->dma_map.iova == IOVA_INVALID) {
+		fprintf(stderr, "no IOVA space left for the DMA arena\n");
+		goto free;
+	}
+
+	if (ioctl(params->container, VFIO_IOMMU_MAP_DMA, &arena->dma_map)) {
+		perror("failed to map the DMA arena");
+
+		iova_free(params->iova, arena->dma_map.iova, size);
+		goto free;
+	}
+
+	return arena;
+
+free:
+	munmap(va, size);
+	free(arena);
+
+	return NULL;
+}
+
+/*
+ * Hands out the given no. of bytes from the arena, aligned to 'align' (power of 2).
+ * The IOVA of the memory is returned in 'iova'. Memory is zeroed since the arena
+ * is never recycled while it lives.
+ */
+void* dma_arena_alloc(struct dma_arena *arena, u64 size, u64 align, u64 *iova)
+{
+	u64 off = GET_ALIGNED_PAGE(arena->used, align);
+
+	if (off + size > arena->dma_map.size)
+		return NULL;
+
+	arena->used = off + size;
+	*iova = arena->dma_map.iova + off;
+
+	return (void*)(arena->dma_map.vaddr + off);
+}
+
+/* Unmaps and frees the DMA arena, along with everything handed out of it */
+void dma_arena_destroy(const struct vfio_hlvl_params *params, struct dma_arena *arena)
+{
+	if (!arena)
+		return;
+
+	iommu_unmap_va(params->container, &arena->dma_map);
+	iova_free(params->iova, arena->dma_map.iova, arena->dma_map.size);
+	munmap((void*)arena->dma_map.vaddr, arena->dma_map.size);
+	free(arena);
+}
+
+/*
+ * Fetches the IOMMU info of the given container once: the supported page sizes, the
+ * usable IOVA ranges and the DMA mapping limit, the last two from the capability
+ * chain if the kernel reports them.
+ */
+int get_iommu_info(int container, struct iommu_info *iommu)
+{
+	struct vfio_iommu_type1_info_cap_iova_range *cap_range;
+	struct vfio_iommu_type1_info_dma_avail *cap_avail;
+	struct vfio_iommu_type1_info *info;
+	struct vfio_info_cap_header *hdr;
+	u32 off;
+
+	memset(iommu, 0, sizeof(struct iommu_info));
+
+	info = calloc(1, sizeof(struct vfio_iommu_type1_info));
+	info->argsz = sizeof(struct vfio_iommu_type1_info);
+
+	if (ioctl(container, VFIO_IOMMU_GET_INFO, info))
+		goto err;
+
+	/* Capability chain doesn't fit in the base structure, fetch it again */
+	if (info->argsz > sizeof(struct vfio_iommu_type1_info)) {
+		info = realloc(info, info->argsz);
+
+		if (ioctl(container, VFIO_IOMMU_GET_INFO, info))
+			goto err;
+	}
+
+	if (!info->iova_pgsizes)
+		goto err;
+
+	iommu->pgsizes = info->iova_pgsizes;
+	iommu->pgsize = get_size_least_set(info->iova_pgsizes);
+
+	if (!(info->flags & VFIO_IOMMU_INFO_CAPS))
+		goto out;
+
+	for (off = info->cap_offset; off; off = hdr->next) {
+		hdr = (struct vfio_info_cap_header*)((u8*)info + off);
+
+		if (hdr->id == VFIO_IOMMU_TYPE1_INFO_CAP_IOVA_RANGE) {
+			cap_range = (struct vfio_iommu_type1_info_cap_iova_range*)hdr;
+
+			iommu->ranges = malloc(cap_range->nr_iovas * sizeof(struct vfio_iova_range));
+			memcpy(iommu->ranges, cap_range->iova_ranges,
+			       cap_range->nr_iovas * sizeof(struct vfio_iova_range));
+			iommu->total_ranges = cap_range->nr_iovas;
+		} else if (hdr->id == VFIO_IOMMU_TYPE1_INFO_DMA_AVAIL) {
+			cap_avail = (struct vfio_iommu_type1_info_dma_avail*)hdr;
+			iommu->dma_avail = cap_avail->avail;
+		}
+	}
+
+out:
+	free(info);
+	return 0;
+
+err:
+	free(info);
+	return EIO;
+}
+
+/*
+ * Creates the IOVA allocator of a container with the given IOMMU info.
+ * The allocator manages 'IOVA_SPACE_SIZE' bytes of IOVA space in units of the
+ * smallest page size supported by the IOMMU, starting from the first usable IOVA.
+ * Pages not fully inside the usable IOVA ranges (e.g., the MSI window) are never
+ * handed out, and neither is IOVA 0, so that a zero address in a descriptor is never
+ * valid.
+ */
+struct iova_allocator* iova_allocator_create(const struct iommu_info *iommu)
+{
+	struct iova_allocator *iova;
+	struct vfio_iova_range *r;
+	u64 first, last, i;
+
+	iova = calloc(1, sizeof(struct iova_allocator));
+	pthread_mutex_init(&iova->lock, NULL);
+
+	iova->pgsize = iommu->pgsize;
+	iova->pages = IOVA_SPACE_SIZE / iova->pgsize;
+	iova->bitmap = malloc(GET_ALIGNED_PAGE(iova->pages, 64) / 8);
+
+	if (iommu->total_ranges) {
+		iova->base = iommu->ranges[0].start & ~(u64)(HUGE_PAGE_SIZE - 1);
+
+		/* Everything is unusable, except the pages inside the ranges */
+		memset(iova->bitmap, 0xff, GET_ALIGNED_PAGE(iova->pages, 64) / 8);
+
+		for (i = 0; i < iommu->total_ranges; i++) {
+			r = &iommu->ranges[i];
+			if (r->end < iova->base)
+				continue;
+
+			first = r->start > iova->base ?
+				GET_ALIGNED_PAGE(r->start - iova->base, iova->pgsize) /
+				iova->pgsize : 0;
+
+			/* 'end' is inclusive, a partially covered last page is dropped */
+			if (r->end - iova->base >= IOVA_SPACE_SIZE)
+				last = iova->pages;
+			else
+				last = (r->end - iova->base + 1) / iova->pgsize;
+
+			for (; first < last; first++)
+				iova->bitmap[first / 64] &= ~((u64)1 << (first % 64));
+		}
+	} else
+		memset(iova->bitmap, 0, GET_ALIGNED_PAGE(iova->pages, 64) / 8);
+
+	if (!iova->base)
+		iova->bitmap[0] |= 1;
+
+	iova->reserved = malloc(GET_ALIGNED_PAGE(iova->pages, 64) / 8);
+	memcpy(iova->reserved, iova->bitmap, GET_ALIGNED_PAGE(iova->pages, 64) / 8);
+
+	for (i = 0; i < iova->pages; i++)
+		iova->stats.total += !(iova->bitmap[i / 64] & ((u64)1 << (i % 64)));
+
+	return iova;
+}
+
+void iova_allocator_destroy(struct iova_allocator *iova)
+{
+	if (!iova)
+		return;
+
+	pthread_mutex_destroy(&iova->lock);
+	free(iova->bitmap);
+	free(iova->reserved);
+	free(iova);
+}
+
+/*
+ * Allocates 'size' bytes of IOVA space, aligned to 'align' (power of 2). Both are
+ * rounded up to the IOMMU page size. First-fit is used, so that a steady stream of
+ * map/unmap keeps recycling the same few pages.
+ * Returns the IOVA, or 'IOVA_INVALID' if no space is left.
+ */
+u64 iova_alloc(struct iova_allocator *iova, u64 size, u64 align)
+{
+	u64 num = GET_ALIGNED_PAGE(size, iova->pgsize) / iova->pgsize;
+	u64 pg, i, ret = IOVA_INVALID;
+
+	align = align > iova->pgsize ? align / iova->pgsize : 1;
+	if (!num)
+		return ret;
+
+	pthread_mutex_lock(&iova->lock);
+
+	pg = GET_ALIGNED_PAGE(iova->first_free, align);
+
+	while (pg + num <= iova->pages) {
+		for (i = 0; i < num; i++) {
+			if (iova->bitmap[(pg + i) / 64] & ((u64)1 << ((pg + i) % 64)))
+				break;
+		}
+
+		if (i == num) {
+			ret = iova->base + pg * iova->pgsize;
+			break;
+		}
+
+		pg = GET_ALIGNED_PAGE(pg + i + 1, align);
+	}
+
+	if (ret == IOVA_INVALID) {
+		iova->stats.failures++;
+		goto unlock;
+	}
+
+	for (i = pg; i < pg + num; i++)
+		iova->bitmap[i / 64] |= (u64)1 << (i % 64);
+
+	/* Move the search start past the pages in use */
+	if (pg == iova->first_free) {
+		for (i = pg + num; i < iova->pages; i++) {
+			if (!(iova->bitmap[i / 64] & ((u64)1 << (i % 64))))
+				break;
+		}
+
+		iova->first_free = i;
+	}
+
+	iova->stats.in_use += num;
+	if (iova->stats.in_use > iova->stats.peak)
+		iova->stats.peak = iova->stats.in_use;
+	iova->stats.allocs++;
+
+unlock:
+	pthread_mutex_unlock(&iova->lock);
+
+	return ret;
+}
+
+/*
+ * Returns the IOVA space allocated via 'iova_alloc' back to the allocator.
+ * A range not entirely allocated (e.g., freed twice) is left alone with a warning,
+ * so that it can't release the pages handed out to someone else since.
+ */
+void iova_free(struct iova_allocator *iova, u64 addr, u64 size)
+{
+	u64 num = GET_ALIGNED_PAGE(size, iova->pgsize) / iova->pgsize;
+	u64 pg = (addr - iova->base) / iova->pgsize;
+	u64 i;
+
+	if ((addr < iova->base) || (pg + num > iova->pages)) {
+		fprintf(stderr, "IOVA 0x%" PRIx64 " (0x%" PRIx64 " bytes) out of range\n", addr,
+			size);
+		return;
+	}
+
+	pthread_mutex_lock(&iova->lock);
+
+	for (i = pg; i < pg + num; i++) {
+		if (!(iova->bitmap[i / 64] & ~iova->reserved[i / 64] & ((u64)1 << (i % 64)))) {
+			fprintf(stderr, "IOVA 0x%" PRIx64 " (0x%" PRIx64 " bytes) not allocated\n",
+				addr, size);
+			goto unlock;
+		}
+	}
+
+	for (i = pg; i < pg + num; i++)
+		iova->bitmap[i / 64] &= ~((u64)1 << (i % 64));
+
+	if (pg < iova->first_free)
+		iova->first_free = pg;
+
+	iova->stats.in_use -= num;
+	iova->stats.frees++;
+
+unlock:
+	pthread_mutex_unlock(&iova->lock);
+}
+
+/* Returns a snapshot of the usage stats of the given container's IOVA allocator */
+void get_iova_stats(const struct vfio_hlvl_params *params, struct iova_stats *stats)
+{
+	pthread_mutex_lock(&params->iova->lock);
+	*stats = params->iova->stats;
+	pthread_mutex_unlock(&params->iova->lock);
+}
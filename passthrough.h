@@ -6,29 +6,140 @@
  */
 
 #include <linux/vfio.h>
+#include <pthread.h>
 
 #include "host_regs.h"
 
+/*
+ * User-space mapping of a BAR region, kept for the lifetime of the device.
+ * [start, end) is the range of the region in the host interface space, where the
+ * BAR regions are laid out one after the other.
+ */
+struct bar_map {
+	u64 start;
+	u64 end;
+	struct vfio_region_info *region_info;
+	void *va;	/* NULL if the region doesn't support mmap */
+};
+
+#define IOVA_INVALID	COMPLEMENT_BIT64
+
+/* IOMMU info of a container, fetched once via 'VFIO_IOMMU_GET_INFO' */
+struct iommu_info {
+	u64 pgsizes;			/* Bitmap of the supported page sizes */
+	u64 pgsize;			/* Smallest supported page size */
+	struct vfio_iova_range *ranges;	/* Usable IOVA ranges, NULL if not reported */
+	u32 total_ranges;
+	u32 dma_avail;			/* DMA mappings allowed, 0 if not reported */
+};
+
+/* Usage stats of an IOVA allocator, in IOMMU pages (except the counters) */
+struct iova_stats {
+	u64 total;	/* Usable pages */
+	u64 in_use;
+	u64 peak;
+	u64 allocs;
+	u64 frees;
+	u64 failures;
+};
+
+/*
+ * Bitmap allocator of the IOVA space of a container, so that the IOVAs of the freed
+ * DMA mappings are recycled.
+ */
+struct iova_allocator {
+	pthread_mutex_t lock;
+	u64 pgsize;	/* Smallest page size supported by the IOMMU */
+	u64 base;	/* IOVA of the first page in the bitmap */
+	u64 pages;
+	u64 *bitmap;	/* Set for the pages in use or outside the usable IOVA ranges */
+	u64 *reserved;	/* Set for the pages never to be handed out, nor freed */
+	u64 first_free;	/* No free page below this one */
+	struct iova_stats stats;
+};
+
+/*
+ * Contiguous DMA memory mapped in the IOMMU once, out of which the descriptor rings
+ * and the packet buffers are carved by offset.
+ */
+struct dma_arena {
+	struct vfio_iommu_type1_dma_map dma_map;
+	u64 used;	/* Offset of the first free byte */
+	bool huge;	/* Backed by huge pages */
+};
+
 struct vfio_hlvl_params {
 	int container;
 	int group;
 	int device;
 	struct vfio_device_info *dev_info;
-	struct list_item *bar_regions;
+	struct iommu_info iommu;
+	struct iova_allocator *iova;
+
+	/* Sorted by 'start', built once in 'get_dev_bar_regions' */
+	struct bar_map *bar_maps;
+	u8 total_bars;
+
 	struct vfio_region_info *pci_cfg_region;
+
+	/* Eventfds of the enabled MSI-X (or MSI) vectors, see 'enable_dev_irqs' */
+	int *irq_fds;
+	u32 total_irqs;
+	u32 irq_index;
 };
 
+void check_vfio_no_iommu(void);
+void set_no_iommu_check_interval(u32 interval_ms);
 bool check_vfio_module(void);
-struct pci_vdid* bind_grp_modules(const char *pci_id);
+struct pci_vdid* bind_grp_modules(const char *pci_id, u64 *num);
 void unbind_grp_modules(struct pci_vdid *dev_list, u64 num);
 struct vfio_hlvl_params* vfio_dev_init(const char *pci_id);
 void get_dev_bar_regions(struct vfio_hlvl_params *params);
+void free_dev_bar_regions(struct vfio_hlvl_params *params);
 void get_dev_pci_cfg_region(struct vfio_hlvl_params *params);
-struct vfio_region_info* find_bar_for_off(struct list_item *bar_regions, u64 off);
+struct bar_map* find_bar_map_for_off(const struct vfio_hlvl_params *params, u64 off);
+struct vfio_region_info* find_bar_for_off(const struct vfio_hlvl_params *params, u64 off);
 u32 read_host_mem_long(const struct vfio_hlvl_params *params, u64 off);
 u16 read_host_mem_word(const struct vfio_hlvl_params *params, u64 off);
 u8 read_host_mem_byte(const struct vfio_hlvl_params *params, u64 off);
 void write_host_mem(const struct vfio_hlvl_params *params, u64 off, u32 value);
-struct vfio_iommu_type1_dma_map* iommu_map_va(int container, u8 op_flags, u8 index);
+int read_host_mem_block(const struct vfio_hlvl_params *params, u64 off, u32 *buf,
+			u64 dwords);
+int write_host_mem_block(const struct vfio_hlvl_params *params, u64 off,
+			 const u32 *buf, u64 dwords);
+int enable_dev_irqs(struct vfio_hlvl_params *params, u32 num);
+void disable_dev_irqs(struct vfio_hlvl_params *params);
+struct vfio_iommu_type1_dma_map* iommu_map_va(const struct vfio_hlvl_params *params,
+					       u8 op_flags);
 void iommu_unmap_va(int container, struct vfio_iommu_type1_dma_map *dma_map);
-void free_dma_map(int container, struct vfio_iommu_type1_dma_map *dma_map);
+void free_dma_map(const struct vfio_hlvl_params *params,
+		  struct vfio_iommu_type1_dma_map *dma_map);
+struct dma_arena* dma_arena_create(const struct vfio_hlvl_params *params, u64 size);
+void* dma_arena_alloc(struct dma_arena *arena, u64 size, u64 align, u64 *iova);
+void dma_arena_destroy(const struct vfio_hlvl_params *params, struct dma_arena *arena);
+int get_iommu_info(int container, struct iommu_info *iommu);
+struct iova_allocator* iova_allocator_create(const struct iommu_info *iommu);
+void iova_allocator_destroy(struct iova_allocator *iova);
+u64 iova_alloc(struct iova_allocator *iova, u64 size, u64 align);
+void iova_free(struct iova_allocator *iova, u64 addr, u64 size);
+void get_iova_stats(const struct vfio_hlvl_params *params, struct iova_stats *stats);
+
+/*
+ * Returns the user-space address of the dword at the given offset in the host
+ * interface space, or NULL if it isn't mapped.
+ * All the host interface registers (see 'host_regs.h') reside in the first BAR,
+ * hence check it upfront before looking up the other regions.
+ */
+static inline volatile u32* host_mem_ptr(const struct vfio_hlvl_params *params, u64 off)
+{
+	const struct bar_map *map = params->bar_maps;
+
+	if (__builtin_expect(params->total_bars && off + sizeof(u32) <= map->end, 1))
+		return map->va ? (volatile u32*)(map->va + off) : NULL;
+
+	map = find_bar_map_for_off(params, off);
+	if (!map || !map->va)
+		return NULL;
+
+	return (volatile u32*)(map->va + (off - map->start));
+}
@@ -9,8 +9,13 @@
  * Copyright (C) 2023 Intel Corporation
  */
 
+#include <dirent.h>
+#include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 
 #include "pciutils.h"
@@ -21,97 +26,238 @@ char *pci_dev_sysfs_path = "/sys/bus/pci/devices/";
 /* Perform a PCI rescan */
 void do_pci_rescan(void)
 {
-	char *path = "echo 1 > /sys/bus/pci/rescan";
-	char *root_cmd, *bash_op;
+	int ret;
 
-	if (is_link_nabs("/sys/bus/pci/rescan"))
-		exit(1);
-
-	root_cmd = switch_cmd_to_root(path);
-	bash_op = do_bash_cmd(root_cmd);
-
-	free(root_cmd);
-	free(bash_op);
+	ret = write_sysfs_attr(AT_FDCWD, "/sys/bus/pci/rescan", "1");
+	if (ret)
+		fprintf(stderr, "PCI rescan failed: %s\n", strerror(ret));
 }
 
 /* Remove the provided PCI device from the system */
 void remove_pci_dev(const char *pci_id)
 {
-	char path[MAX_LEN], check[MAX_LEN];
-	char *root_cmd, *bash_op;
+	int dir_fd = open_pci_dev_dir(pci_id);
+	int ret = ENODEV;
 
-	snprintf(check, sizeof(check), "%s%s/remove", pci_dev_sysfs_path, pci_id);
-	if (is_link_nabs(check))
-		exit(1);
+	if (dir_fd >= 0) {
+		ret = write_sysfs_attr(dir_fd, "remove", "1");
+		close(dir_fd);
+	}
 
-	snprintf(path, sizeof(path), "echo 1 > %s%s/remove", pci_dev_sysfs_path,
-		 pci_id);
-	root_cmd = switch_cmd_to_root(path);
-	bash_op = do_bash_cmd(root_cmd);
+	if (ret)
+		fprintf(stderr, "failed to remove %s: %s\n", pci_id, strerror(ret));
+}
+
+/* Opens the sysfs directory of the given PCI device, returns -1 on failure */
+int open_pci_dev_dir(const char *pci_id)
+{
+	char path[MAX_LEN];
+
+	snprintf(path, sizeof(path), "%s%s", pci_dev_sysfs_path, pci_id);
 
-	free(root_cmd);
-	free(bash_op);
+	return open_sysfs_dir(path);
 }
 
 /* Get vendor and device IDs for the given PCI device */
 struct vdid* get_vdid(const char *pci_id)
 {
-	char *vdid_char = malloc(MAX_LEN * sizeof(char));
-	struct vdid *vdid = malloc(sizeof(struct vdid));
+	struct vdid *vdid = calloc(1, sizeof(struct vdid));
+	int dir_fd = open_pci_dev_dir(pci_id);
+	u32 vid = 0, did = 0;
+
+	if (dir_fd >= 0) {
+		read_sysfs_attr_hex(dir_fd, "vendor", &vid);
+		read_sysfs_attr_hex(dir_fd, "device", &did);
+		close(dir_fd);
+	}
+
+	snprintf(vdid->vendor_id, VDID_LEN + 1, "%04x", vid);
+	snprintf(vdid->device_id, VDID_LEN + 1, "%04x", did);
+
+	return vdid;
+}
+
+/*
+ * Returns the PCI IDs of all the modules present in the same IOMMU group as the given
+ * PCI device (including itself), and their count in 'num'. Both the array and the
+ * IDs are to be freed by the caller.
+ */
+char** get_grp_modules(const char *pci_id, u64 *num)
+{
+	struct dirent *entry;
 	char path[MAX_LEN];
-	char *bash_result;
-	u16 pos;
+	char **ids = NULL;
+	u64 cap = 0;
+	DIR *dir;
 
-	snprintf(path, sizeof(path), "lspci -n -s %s", pci_id);
+	*num = 0;
 
-	bash_result = do_bash_cmd(path);
+	snprintf(path, sizeof(path), "%s%s/iommu_group/devices", pci_dev_sysfs_path,
+		 pci_id);
 
-	pos = strpos(bash_result, INTEL_VID, 0);
+	dir = opendir(path);
+	if (!dir)
+		return NULL;
 
-	strncpy(vdid_char, bash_result + pos, TRIM_VDID_PATH - 1);
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
 
-	strncpy(vdid->vendor_id, vdid_char, VDID_LEN);
-	strncpy(vdid->device_id, vdid_char + VDID_LEN + 1, VDID_LEN);
+		if (*num == cap) {
+			cap = cap ? 2 * cap : 4;
+			ids = realloc(ids, cap * sizeof(char*));
+		}
 
-	vdid->vendor_id[VDID_LEN] = '\0';
-	vdid->device_id[VDID_LEN] = '\0';
+		ids[(*num)++] = strdup(entry->d_name);
+	}
 
-	free(vdid_char);
-	free(bash_result);
+	closedir(dir);
 
-	return vdid;
+	return ids;
 }
 
-/* Make the respective PCIe device use DMA */
-void allow_bus_master(const char *pci_id)
+/*
+ * Opens the PCI config. space of the given device. The VFIO config. region is used if
+ * the device is already set up in 'params' (may be NULL), else the sysfs 'config'
+ * file of the device.
+ * Returns 0 on success, else the error of opening the sysfs file.
+ */
+int open_pci_cfg(struct pci_cfg *cfg, const char *pci_id,
+		 const struct vfio_hlvl_params *params)
 {
-	char *root_cmd, *bash_op;
 	char path[MAX_LEN];
 
-	/* To avoid any conflicts, set the MM mapping accessibility also */
-	snprintf(path, sizeof(path), "setpci -s %s 0x%x.B=0x%x", pci_id, PCI_CMD,
-		 PCI_CMD_MASTER | PCI_CMD_MEM);
+	if (params && params->pci_cfg_region) {
+		cfg->fd = params->device;
+		cfg->base = params->pci_cfg_region->offset;
+		cfg->owned = false;
+
+		return 0;
+	}
+
+	snprintf(path, sizeof(path), "%s%s/config", pci_dev_sysfs_path, pci_id);
+
+	cfg->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (cfg->fd < 0)
+		return errno;
+
+	cfg->base = 0;
+	cfg->owned = true;
+
+	return 0;
+}
+
+void close_pci_cfg(struct pci_cfg *cfg)
+{
+	if (cfg->owned && (cfg->fd >= 0))
+		close(cfg->fd);
+
+	cfg->fd = -1;
+}
+
+/*
+ * Reads/writes 'size' bytes of the config. space at the given offset, as a single
+ * access of that width.
+ * Return: 0 on success, ERANGE for an offset past the config. space, EIO otherwise.
+ */
+static int pci_cfg_rw(const struct pci_cfg *cfg, u16 off, void *buf, u8 size, bool write)
+{
+	ssize_t len;
+
+	if ((off + size > PCI_CFG_SIZE) || (off % size))
+		return ERANGE;
+
+	if (write)
+		len = pwrite(cfg->fd, buf, size, cfg->base + off);
+	else
+		len = pread(cfg->fd, buf, size, cfg->base + off);
 
-	root_cmd = switch_cmd_to_root(path);
-	bash_op = do_bash_cmd(root_cmd);
+	return len == size ? 0 : EIO;
+}
+
+/* Config. space is little-endian */
+int pci_cfg_read_long(const struct pci_cfg *cfg, u16 off, u32 *val)
+{
+	int ret = pci_cfg_rw(cfg, off, val, sizeof(*val), false);
+
+	*val = le32toh(*val);
+
+	return ret;
+}
+
+int pci_cfg_write_long(const struct pci_cfg *cfg, u16 off, u32 val)
+{
+	val = htole32(val);
+
+	return pci_cfg_rw(cfg, off, &val, sizeof(val), true);
+}
+
+/* Clears the bits of 'clr' and then sets the bits of 'set' in the dword at 'off' */
+int pci_cfg_rmw_long(const struct pci_cfg *cfg, u16 off, u32 clr, u32 set)
+{
+	u32 val;
+	int ret;
+
+	ret = pci_cfg_read_long(cfg, off, &val);
+	if (ret)
+		return ret;
+
+	return pci_cfg_write_long(cfg, off, (val & ~clr) | set);
+}
+
+int pci_cfg_read_word(const struct pci_cfg *cfg, u16 off, u16 *val)
+{
+	int ret = pci_cfg_rw(cfg, off, val, sizeof(*val), false);
 
-	free(root_cmd);
-	free(bash_op);
+	*val = le16toh(*val);
+
+	return ret;
+}
+
+int pci_cfg_write_word(const struct pci_cfg *cfg, u16 off, u16 val)
+{
+	val = htole16(val);
+
+	return pci_cfg_rw(cfg, off, &val, sizeof(val), true);
+}
+
+/* Word-wide counterpart of 'pci_cfg_rmw_long' */
+int pci_cfg_rmw_word(const struct pci_cfg *cfg, u16 off, u16 clr, u16 set)
+{
+	u16 val;
+	int ret;
+
+	ret = pci_cfg_read_word(cfg, off, &val);
+	if (ret)
+		return ret;
+
+	return pci_cfg_write_word(cfg, off, (val & ~clr) | set);
+}
+
+/* Updates the command register, leaving the bits other than 'clr' and 'set' as is */
+int set_pci_cmd(const struct pci_cfg *cfg, u16 clr, u16 set)
+{
+	return pci_cfg_rmw_word(cfg, PCI_CMD, clr, set);
+}
+
+/* Make the respective PCIe device use DMA */
+int allow_bus_master(const struct pci_cfg *cfg)
+{
+	/* To avoid any conflicts, set the MM mapping accessibility also */
+	return set_pci_cmd(cfg, 0, PCI_CMD_MASTER | PCI_CMD_MEM);
 }
 
 /* Returns the total modules present in the same IOMMU group as the given PCI device */
 u64 total_grp_modules(const char *pci_id)
 {
-	struct list_item *list_modules;
-	char path[MAX_LEN];
-	u64 ret;
+	char **ids;
+	u64 num, i = 0;
 
-	snprintf(path, sizeof(path), "for line in $(ls %s%s/iommu_group/devices); do echo $line; done",
-		 pci_dev_sysfs_path, pci_id);
+	ids = get_grp_modules(pci_id, &num);
 
-	list_modules = do_bash_cmd_list(path);
-	ret = get_total_list_items(list_modules);
+	for (; i < num; i++)
+		free(ids[i]);
+	free(ids);
 
-	free_list(list_modules);
-	return ret;
+	return num;
 }
@@ -8,7 +8,6 @@
 #include "passthrough.h"
 
 #define VDID_LEN		4
-#define TRIM_VDID_PATH		10
 
 #define INTEL_VID		"8086"
 
@@ -16,6 +15,8 @@
 #define PCI_CMD_MEM		0x2
 #define PCI_CMD_MASTER		0x4
 
+#define PCI_CFG_SIZE		0x1000
+
 extern char *pci_drv_sysfs_path;
 extern char *pci_dev_sysfs_path;
 
@@ -29,8 +30,30 @@ struct pci_vdid {
 	struct vdid *vdid;
 };
 
+/*
+ * Accessor of the PCI config. space of a device, either the VFIO config. region of
+ * the device fd or the sysfs 'config' file.
+ */
+struct pci_cfg {
+	int fd;
+	u64 base;	/* Offset of the config. space in 'fd' */
+	bool owned;	/* 'fd' was opened by the accessor and is to be closed */
+};
+
+int open_pci_cfg(struct pci_cfg *cfg, const char *pci_id,
+		 const struct vfio_hlvl_params *params);
+void close_pci_cfg(struct pci_cfg *cfg);
+int pci_cfg_read_long(const struct pci_cfg *cfg, u16 off, u32 *val);
+int pci_cfg_write_long(const struct pci_cfg *cfg, u16 off, u32 val);
+int pci_cfg_rmw_long(const struct pci_cfg *cfg, u16 off, u32 clr, u32 set);
+int pci_cfg_read_word(const struct pci_cfg *cfg, u16 off, u16 *val);
+int pci_cfg_write_word(const struct pci_cfg *cfg, u16 off, u16 val);
+int pci_cfg_rmw_word(const struct pci_cfg *cfg, u16 off, u16 clr, u16 set);
+int set_pci_cmd(const struct pci_cfg *cfg, u16 clr, u16 set);
 void do_pci_rescan(void);
 void remove_pci_dev(const char *pci_id);
+int open_pci_dev_dir(const char *pci_id);
 struct vdid* get_vdid(const char *pci_id);
-void allow_bus_master(const char *pci_id);
+char** get_grp_modules(const char *pci_id, u64 *num);
+int allow_bus_master(const struct pci_cfg *cfg);
 u64 total_grp_modules(const char *pci_id);
@@ -15,10 +15,14 @@
 #define ROUTER_CFG	2
 #define CNTR_CFG	3
 
-/* EOF/SOF of read/write packets */
+/* EOF/SOF of error/read/write packets */
+#define EOF_SOF_ERROR	0
 #define EOF_SOF_READ	1
 #define EOF_SOF_WRITE	2
 
+/* Set by the routers in the route of the packets they send to the CM */
+#define ROUTE_HIGH_CM	BIT(31)
+
 /* Transmit descriptor flags w.r.t. the position of 'flags' in the descriptor's memory */
 #define TX_DESC_DONE	BIT(1)
 #define TX_REQ_STS	BIT(2)
@@ -30,9 +34,25 @@
 #define RX_REQ_STS	BIT(2)
 #define RX_INT_EN	BIT(3)
 
-/* Max. amount of time(us) taken by the router to write back into the host memory */
+/* Rings reported by 'wait_for_ring_event' */
+#define RING_EVENT_TX	BIT(0)
+#define RING_EVENT_RX	BIT(1)
+
+/*
+ * Max. amount of time(us) taken by the router to write back into the host memory.
+ * Default deadline of a control request, see 'set_ctrl_timeout'.
+ */
 #define CTRL_TIMEOUT	2000
 
+/*
+ * Default deadline (us) of the f/w getting ready after the power is forced on, see
+ * 'set_fw_ready_timeout'.
+ */
+#define FW_READY_TIMEOUT	1750000
+
+/* Buckets of the f/w ready latency histogram, see 'struct fw_ready_stats' */
+#define FW_READY_HIST_BUCKETS	24
+
 /* HopID and SuppID for control packets */
 #define CTRL_HOP	0x0
 #define CTRL_SUPP	0x0
@@ -40,6 +60,35 @@
 #define TX_SIZE		16
 #define RX_SIZE		16
 
+/* MSI-X vectors of the rings, RX shares the TX one if only one vector is available */
+#define TX_RING_VEC		0
+#define RX_RING_VEC		1
+
+/* Requests in flight: one TX descriptor is always kept free, 2-bit sequence no. */
+#define MAX_INFLIGHT		(TX_SIZE - 1)
+#define MAX_INFLIGHT_PER_ROUTE	4
+
+/* Max. no. of dwords read/written by a single control packet */
+#define MAX_CTRL_DWORDS	60
+
+/* Config. space is addressed in dwords with 13 bits */
+#define MAX_CFG_DWORDS	BIT(13)
+
+/* Adapters are addressed with 6 bits */
+#define MAX_ADPS	BIT(6)
+
+/* Max. size of a control packet, i.e., route, 60 dwords of payload, etc. and CRC */
+#define TX_BUF_SIZE	256
+
+/* Size of the RX data buffers, as programmed in 'RX_RING_BUF_SIZE' (0 = 4096) */
+#define RX_BUF_SIZE	4096
+
+/* Notifications kept per controller until fetched, see 'get_ctrl_notification' */
+#define MAX_NOTIFICATIONS	16
+
+/* Size of the DMA memory mapped at once for the rings and their buffers */
+#define DMA_ARENA_SIZE	(2 * 1024 * 1024)
+
 struct req_payload {
 	u32 addr:13;
 	u32 len:6;
@@ -64,14 +113,29 @@ struct read_req {
 	u32 crc;
 };
 
-struct write_req {
+/* Read response, followed by 'payload.len' dwords of data and the CRC */
+struct read_resp {
 	u32 route_high;
 	u32 route_low;
 	struct req_payload payload;
-	u32 buf;
+	u32 data[];
+};
+
+struct error_resp {
+	u32 route_high;
+	u32 route_low;
+	u32 err;
 	u32 crc;
 };
 
+/* Write request, followed by 'payload.len' dwords of data and the CRC */
+struct write_req {
+	u32 route_high;
+	u32 route_low;
+	struct req_payload payload;
+	u32 data[];
+};
+
 /* Ring descriptor */
 struct ring_desc {
 	u32 addr_low;
@@ -82,3 +146,126 @@ struct ring_desc {
 	u32 flags:12;
 	u32 rsvd;
 };
+
+/* Completion stats of the control requests, latencies in ns */
+struct ctrl_req_stats {
+	u64 completed;
+	u64 timeouts;
+	u64 crc_errors;		/* Responses dropped due to bad CRC */
+	u64 unmatched;		/* Responses not matching any outstanding request */
+	u64 dropped_notifs;	/* Notifications dropped due to a full queue */
+	u64 last_ns;
+	u64 min_ns;
+	u64 max_ns;
+	u64 total_ns;
+};
+
+/*
+ * F/w ready latencies of the h/w bring-ups so far. Bucket 'i' of the histogram counts
+ * the latencies in [2^i, 2^(i + 1)) us, the first one also the ones below 1 us and the
+ * last one all the ones beyond.
+ */
+struct fw_ready_stats {
+	u64 runs;
+	u64 timeouts;
+	u64 last_ns;
+	u64 min_ns;
+	u64 max_ns;
+	u64 total_ns;		/* Of the successful runs */
+	u64 hist[FW_READY_HIST_BUCKETS];
+};
+
+/*
+ * Control request for the asynchronous engine, see 'submit_ctrl_reqs'. Callers fill
+ * in the first block, the rest belongs to the engine until 'done' is set.
+ */
+struct ctrl_req {
+	u64 route;
+	u32 addr;
+	u8 adp;
+	u8 cfg_space;
+	u8 dwords;
+	u32 *buf;		/* Receives the data of a read */
+	const u32 *data;	/* Data to write, NULL for a read */
+
+	int status;
+	bool done;
+	u64 latency_ns;
+
+	struct req_payload payload;
+	u64 start;		/* ns, monotonic */
+};
+
+/*
+ * Control packet received without being asked for, e.g., a hot-plug event or an error
+ * not meant for any request. 'data' holds the dwords following the route, CRC
+ * excluded, in host order.
+ */
+struct ctrl_notification {
+	u64 route;
+	u8 pdf;
+	u8 dwords;
+	u32 data[TX_BUF_SIZE / 4];
+};
+
+/*
+ * Host thunderbolt controller (NHI), owning its VFIO params, ring 0 and all the state
+ * of the control requests, see 'tbt_ctlr_open'.
+ */
+struct tbt_ctlr {
+	char *pci_id;
+	struct vfio_hlvl_params *params;
+
+	/* Modules of the IOMMU group, bound to VFIO */
+	struct pci_vdid *dev_list;
+	u64 total_modules;
+
+	/* List of the descriptors for ring 0 of TX and RX */
+	struct va_phy_addr tx_desc[TX_SIZE];
+	struct va_phy_addr rx_desc[RX_SIZE];
+
+	/* Control packet buffers, tied one-to-one to the TX/RX descriptors */
+	struct va_phy_addr tx_buf[TX_SIZE];
+	struct va_phy_addr rx_buf[RX_SIZE];
+
+	/* DMA arena housing the descriptor rings, shared by TX and RX */
+	struct dma_arena *arena;
+
+	/*
+	 * Currently used descriptors. TX descriptors from 'tx_clean' up to (excluding)
+	 * 'tx_index' are posted to the h/w and not yet seen done. RX descriptors from
+	 * 'rx_index' up to (excluding) 'rx_head' are posted to the h/w. One descriptor
+	 * of each ring is always kept free to tell a full ring apart from an empty one.
+	 */
+	u8 tx_index;
+	u8 tx_clean;
+	u8 rx_index;
+	u8 rx_head;
+
+	/* When each TX descriptor was posted, to tell a stuck TX ring */
+	u64 tx_posted[TX_SIZE];
+
+	/* Requests waiting for their responses, in no particular order */
+	struct ctrl_req *inflight[MAX_INFLIGHT];
+	u8 total_inflight;
+
+	/* Notifications received and not yet fetched, oldest at 'notif_head' */
+	struct ctrl_notification notifs[MAX_NOTIFICATIONS];
+	u8 notif_head;
+	u8 total_notifs;
+
+	/* Deadline of a control request (us) and the completion stats */
+	u64 ctrl_timeout;
+	struct ctrl_req_stats req_stats;
+
+	/* Deadline of the f/w getting ready (us) */
+	u64 fw_ready_timeout;
+
+	/* Epoll instance waiting on the ring vectors, valid in the interrupt mode only */
+	int irq_epfd;
+	int ring_vec_fds[RX_RING_VEC + 1];
+	u32 total_ring_vecs;
+	u32 rx_ring_index;
+	/* 'HOST_CTRL' as it was before the interrupt mode */
+	u32 host_ctrl;
+};
@@ -6,12 +6,23 @@
  * including:
  * 1. Thunderbolt h/w initialization
  * 2. Host interface config. space access
- * 3. Dynamic allocation and mapping of DMA control packets as and when required
+ * 3. Descriptor rings and control packet buffers carved out of a single, contiguous
+ *    DMA arena, mapped once
+ * 4. Polled or interrupt-driven (MSI-X) completions of the ring 0
+ * 5. Receiving the responses on RX ring 0, matched to the outstanding requests, and
+ *    the notifications
+ * 6. Pipelined, batched config. space reads and writes
+ * 7. Controller contexts, so that the controllers of all the domains can be driven
+ *    concurrently
  *
  * Copyright (C) 2023 Rajat Khandelwal <rajat.khandelwal@intel.com>
  * Copyright (C) 2023 Intel Corporation
  */
 
+#include <sys/epoll.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
@@ -24,42 +35,40 @@
 
 static char *tbt_sysfs_path = "/sys/bus/thunderbolt/devices/";
 
-/* List of the descriptors for ring 0 of TX and RX */
-static struct va_phy_addr tx_desc[TX_SIZE];
-static struct va_phy_addr rx_desc[RX_SIZE];
-
-/* Currently used descriptors */
-static u8 tx_index = 0;
-/* Unusable for now */
-/*static u8 rx_index = 0;*/
-
-/* A static page index to keep track of iova offset to be given */
-static u64 page_index = 0;
+/* F/w ready latencies of the bring-ups of all the controllers */
+static struct fw_ready_stats fw_stats;
+static pthread_mutex_t fw_stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Returns the total thunderbolt domains present in the system */
-static u8 total_domains(void)
+u8 total_domains(void)
 {
-	char path[MAX_LEN];
-	char *output;
+	struct dirent *entry;
+	u8 num = 0;
+	DIR *dir;
 
-	snprintf(path, sizeof(path), "ls 2>/dev/null %s | grep domain | wc -l",
-		 tbt_sysfs_path);
+	dir = opendir(tbt_sysfs_path);
+	if (!dir)
+		return 0;
 
-	output = do_bash_cmd(path);
+	while ((entry = readdir(dir))) {
+		if (!strncmp(entry->d_name, "domain", strlen("domain")))
+			num++;
+	}
 
-	return strtoud(output);
+	closedir(dir);
+
+	return num;
 }
 
-static void tx_index_inc(void)
+static void tx_index_inc(struct tbt_ctlr *ctlr)
 {
-	tx_index = (tx_index + 1) % TX_SIZE;
+	ctlr->tx_index = (ctlr->tx_index + 1) % TX_SIZE;
 }
 
-/* Unusable for now */
-/*static void rx_index_inc(void)
+static void rx_index_inc(struct tbt_ctlr *ctlr)
 {
-	rx_index = (rx_index + 1) % RX_SIZE;
-}*/
+	ctlr->rx_index = (ctlr->rx_index + 1) % RX_SIZE;
+}
 
 /* Unusable for now */
 /*static struct tport_header* make_tport_header(u64 len, u8 pdf)
@@ -83,248 +92,765 @@ static void tx_index_inc(void)
 	return header;
 }*/
 
-static struct req_payload* make_req_payload(u32 addr, u64 len, u32 adp, u32 cfg_space)
+static struct req_payload make_req_payload(u32 addr, u64 len, u32 adp, u32 cfg_space)
 {
-	struct req_payload *payload = calloc(1, sizeof(struct req_payload));
+	struct req_payload payload = { 0 };
 
-	payload->addr = addr;
-	payload->len = len;
-	payload->adp = adp;
-	payload->cfg_space = cfg_space;
+	payload.addr = addr;
+	payload.len = len;
+	payload.adp = adp;
+	payload.cfg_space = cfg_space;
 
 	return payload;
 }
 
-/* Prepare the transmit descriptor and the read buffer request */
-static struct ring_desc* make_tx_read_req(const struct vfio_hlvl_params *params, u64 route,
-					  const struct req_payload *payload,
-					  struct vfio_iommu_type1_dma_map **dma_map)
+/*
+ * Fills the descriptor of the current TX slot for a request of 'len' bytes, CRC
+ * included. The descriptor already points to the pre-mapped buffer of the slot.
+ */
+static void make_tx_desc(struct tbt_ctlr *ctlr, u32 len, u8 pdf)
 {
-	struct ring_desc *desc;
-	struct read_req *req;
+	struct ring_desc *desc = (struct ring_desc*)ctlr->tx_desc[ctlr->tx_index].va;
 
-	/* DMA mapping for read control request */
-	*dma_map = iommu_map_va(params->container, RDWR_FLAG, page_index++);
+	desc->len = len;
+	desc->eof_pdf = pdf;
+	desc->sof_pdf = pdf;
+	/* Interrupts are gated by 'RING_INT_EN', hence always ask for them */
+	desc->flags = TX_REQ_STS | TX_INT_EN;
+}
 
-	desc = (struct ring_desc*)tx_desc[tx_index].va;
-	desc->addr_low = (*dma_map)->iova & BITMASK(31, 0);
-	desc->addr_high = ((*dma_map)->iova & BITMASK(63, 32)) >> 32;
-	desc->len = sizeof(struct read_req);
-	desc->eof_pdf = EOF_SOF_READ;
-	desc->sof_pdf = EOF_SOF_READ;
-	desc->flags = TX_REQ_STS;
-	desc->rsvd = 0;
+/*
+ * Stores the request header (route and payload) in big-endian straight into the
+ * buffer of the current TX slot, and returns the running CRC over it.
+ */
+static u32 store_req_header(struct tbt_ctlr *ctlr, u64 route,
+			    const struct req_payload *payload)
+{
+	u32 hdr[3];
+
+	hdr[0] = (route & BITMASK(63, 32)) >> 32;
+	hdr[1] = route & BITMASK(31, 0);
+	memcpy(&hdr[2], payload, sizeof(u32));
+
+	return store_be32_crc32(~0, (u32*)ctlr->tx_buf[ctlr->tx_index].va, hdr, 3);
+}
 
-	req = (struct read_req*)(*dma_map)->vaddr;
-	req->route_high = (route & BITMASK(63, 32)) >> 32;
-	req->route_low = route & BITMASK(31, 0);
-	req->payload = *payload;
+/*
+ * Prepare the transmit descriptor and the read request in the current TX slot.
+ * The packet is built in place in the DMA buffer, each dword being byte-swapped,
+ * stored and folded into the CRC in one pass.
+ */
+static void make_tx_read_req(struct tbt_ctlr *ctlr, u64 route,
+			     const struct req_payload *payload)
+{
+	struct read_req *req = (struct read_req*)ctlr->tx_buf[ctlr->tx_index].va;
+	u32 crc;
 
-	convert_to_be32((u32*)req, (sizeof(struct read_req) - 4) / 4);
+	make_tx_desc(ctlr, sizeof(struct read_req), EOF_SOF_READ);
 
-	req->crc = htobe32(~(get_crc32(~0, (u8*)req, sizeof(struct read_req) - 4)));
+	crc = store_req_header(ctlr, route, payload);
+	req->crc = htobe32(~crc);
 
-	return desc;
+	tx_index_inc(ctlr);
 }
 
-/* Prepare the receive descriptor and the write buffer request */
-/* Unusable for now */
-/*static struct ring_desc* make_rx_read_resp(const struct vfio_hlvl_params *params)
+/*
+ * Prepare the transmit descriptor and the write request, carrying 'payload->len'
+ * dwords of 'data', in the current TX slot. Data is stored in place like the header.
+ */
+static void make_tx_write_req(struct tbt_ctlr *ctlr, u64 route,
+			      const struct req_payload *payload, const u32 *data)
 {
-	struct vfio_iommu_type1_dma_map *dma_map;
-	struct ring_desc *desc;
-	struct write_req *resp;
+	struct write_req *req = (struct write_req*)ctlr->tx_buf[ctlr->tx_index].va;
+	u32 crc;
 
-	dma_map = iommu_map_va(params->container, RDWR_FLAG, page_index++);
+	make_tx_desc(ctlr, sizeof(struct write_req) + (payload->len + 1) * 4,
+		     EOF_SOF_WRITE);
 
-	desc = (struct ring_desc*)rx_desc[rx_index].va;
-	memset(desc, sizeof(struct ring_desc), 0);
+	crc = store_req_header(ctlr, route, payload);
+	crc = store_be32_crc32(crc, req->data, data, payload->len);
+	req->data[payload->len] = htobe32(~crc);
 
-	desc->addr_low = dma_map->iova & BITMASK(31, 0);
-	desc->addr_high = (dma_map->iova & BITMASK(63, 32)) >> 32;
-	desc->flags = RX_REQ_STS;
-	desc->rsvd = 0;
+	tx_index_inc(ctlr);
+}
 
-	resp = (struct write_req*)dma_map->vaddr;
-	memset(resp, sizeof(struct write_req), 0);
+/* Hands the RX descriptor at 'rx_head' (and its buffer) over to the h/w */
+static void post_rx_desc(struct tbt_ctlr *ctlr)
+{
+	struct ring_desc *desc = (struct ring_desc*)ctlr->rx_desc[ctlr->rx_head].va;
 
-	return desc;
-}*/
+	desc->len = 0;
+	desc->eof_pdf = 0;
+	desc->sof_pdf = 0;
+	desc->flags = RX_REQ_STS | RX_INT_EN;
+
+	ctlr->rx_head = (ctlr->rx_head + 1) % RX_SIZE;
+}
 
-/* Increases the TX producer index by 1 to start a TX transmission */
-static void tx_start(const struct vfio_hlvl_params *params)
+/*
+ * Hands the RX descriptors up to (excluding) 'rx_head' over to the h/w. Only the
+ * consumer half of the register belongs to the host, the producer one is kept as is.
+ */
+static void write_rx_cons(struct tbt_ctlr *ctlr)
 {
-	u16 prod_index, cons_index, size;
 	u32 val;
 
-	prod_index = (read_host_mem_long(params, TX_PROD_CONS_INDEX) & BITMASK(31, 16)) >> 16;
-	cons_index = read_host_mem_word(params, TX_PROD_CONS_INDEX);
-	size = read_host_mem_word(params, TX_RING_SIZE);
-
-	prod_index = (prod_index + 1) % size;
+	val = read_host_mem_long(ctlr->params, RX_PROD_CONS_INDEX);
+	val &= ~(u32)(RX_CONS_INDEX);
+	val |= ctlr->rx_head;
+	write_host_mem(ctlr->params, RX_PROD_CONS_INDEX, val);
+}
 
-	val = (prod_index << 16) | cons_index;
-	write_host_mem(params, TX_PROD_CONS_INDEX, val);
+/*
+ * Moves the TX producer index up to 'tx_index' to start the transmission of all the
+ * descriptors prepared so far with a single doorbell.
+ * Only the producer half of the register belongs to the host, the consumer one is
+ * kept as is.
+ */
+static void tx_start(struct tbt_ctlr *ctlr)
+{
+	u32 val;
 
-	/* Increment the transmit descriptor index for future transactions */
-	tx_index_inc();
+	val = read_host_mem_long(ctlr->params, TX_PROD_CONS_INDEX);
+	val &= ~(u32)(TX_PROD_INDEX);
+	val |= (u32)ctlr->tx_index << TX_PROD_INDEX_SHIFT;
+	write_host_mem(ctlr->params, TX_PROD_CONS_INDEX, val);
 }
 
-/* Wait for the FW_ready bit to settle down */
-static int tbt_wait_for_pwr(const char *pci_id)
+/*
+ * Restarts TX ring 0 from its first descriptor, dropping the ones posted and not yet
+ * consumed. Both the halves of the index register are the host's to write while the
+ * ring is disabled.
+ */
+static void reset_tx_ring(struct tbt_ctlr *ctlr)
 {
-	char *root_cmd, *bash_op;
-	int ret = ETIMEDOUT;
-	u16 retries = 350; /* TODO: Verify the proper amount of retries */
-	char cmd[MAX_LEN];
+	const struct vfio_hlvl_params *params = ctlr->params;
 	u32 val;
 
-	snprintf(cmd, sizeof(cmd), "setpci -s %s 0x%x.L", pci_id, VS_CAP_9);
-	root_cmd = switch_cmd_to_root(cmd);
+	val = read_host_mem_long(params, TX_RING_CTRL);
+	write_host_mem(params, TX_RING_CTRL, val & ~(u32)(TX_VALID));
 
-	while (retries--) {
-		bash_op = do_bash_cmd(root_cmd);
-		bash_op[8] = '\0';
+	/* Reading back makes sure the ring is disabled before it's reprogrammed */
+	read_host_mem_long(params, TX_RING_CTRL);
 
-		val = strtoud(bash_op);
-		if (val & VS_FW_RDY) {
-			printf("FW_RDY bit is set\n");
-			ret = 0;
+	write_host_mem(params, TX_PROD_CONS_INDEX, 0);
+	ctlr->tx_index = 0;
+	ctlr->tx_clean = 0;
 
-			free(bash_op);
+	write_host_mem(params, TX_RING_CTRL, val | TX_VALID);
+}
 
-			break;
+/*
+ * Returns the no. of TX descriptors available, after reclaiming the ones the h/w is
+ * through with, i.e., marked done or behind its consumer index.
+ * A descriptor still not consumed past the deadline of its request means a stuck
+ * ring, none of whose slots can be reused while the h/w may still fetch them, hence
+ * the ring is reset. Requests of the descriptors dropped time out.
+ */
+static u8 tx_free_slots(struct tbt_ctlr *ctlr, u64 now)
+{
+	volatile struct ring_desc *desc;
+	int cons = -1;
+
+	while (ctlr->tx_clean != ctlr->tx_index) {
+		desc = (volatile struct ring_desc*)ctlr->tx_desc[ctlr->tx_clean].va;
+
+		/* Consumer index is read only once the descriptors marked done run out */
+		if (!(desc->flags & TX_DESC_DONE)) {
+			if (cons < 0)
+				cons = read_host_mem_long(ctlr->params, TX_PROD_CONS_INDEX) &
+				       TX_CONS_INDEX;
+
+			if (ctlr->tx_clean == cons)
+				break;
 		}
 
-		free(bash_op);
+		ctlr->tx_clean = (ctlr->tx_clean + 1) % TX_SIZE;
+	}
 
-		msleep(5);
+	if ((ctlr->tx_clean != ctlr->tx_index) &&
+	    (now - ctlr->tx_posted[ctlr->tx_clean] > ctlr->ctrl_timeout * NSEC_PER_USEC)) {
+		fprintf(stderr, "TX ring 0 stuck, resetting it\n");
+		reset_tx_ring(ctlr);
 	}
 
-	free(root_cmd);
+	return TX_SIZE - 1 - (ctlr->tx_index + TX_SIZE - ctlr->tx_clean) % TX_SIZE;
+}
+
+static void record_req_latency(struct tbt_ctlr *ctlr, u64 lat)
+{
+	if (!ctlr->req_stats.completed || lat < ctlr->req_stats.min_ns)
+		ctlr->req_stats.min_ns = lat;
+	if (lat > ctlr->req_stats.max_ns)
+		ctlr->req_stats.max_ns = lat;
+
+	ctlr->req_stats.last_ns = lat;
+	ctlr->req_stats.total_ns += lat;
+	ctlr->req_stats.completed++;
+}
+
+/*
+ * Waits until the rings are worth another look: sleeps until a ring is signalled in
+ * the interrupt mode, else spins first and backs off gradually, so that the quick
+ * completions are seen right away.
+ * Returns false once the deadline has passed.
+ */
+static bool ring_wait(struct tbt_ctlr *ctlr, struct backoff *b)
+{
+	u32 rings;
+	u64 now;
+
+	if (ctlr->irq_epfd < 0)
+		return backoff_wait(b);
+
+	now = get_time_ns();
+	if (now >= b->deadline)
+		return false;
+
+	wait_for_ring_event(ctlr, (b->deadline - now + 999999) / 1000000, &rings);
+
+	return true;
+}
+
+/* Retires the given in-flight request with the given status */
+static void complete_req(struct tbt_ctlr *ctlr, u8 i, int status, u64 now)
+{
+	struct ctrl_req *req = ctlr->inflight[i];
+
+	ctlr->inflight[i] = ctlr->inflight[--ctlr->total_inflight];
+	ctlr->inflight[ctlr->total_inflight] = NULL;
+
+	req->status = status;
+	req->latency_ns = now - req->start;
+
+	if (status == ETIMEDOUT)
+		ctlr->req_stats.timeouts++;
+	else
+		record_req_latency(ctlr, req->latency_ns);
+
+	/* Let the caller see the data before 'done' */
+	__atomic_store_n(&req->done, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the index of the oldest in-flight request the given response belongs to,
+ * or -1 if none.
+ */
+static int match_req(struct tbt_ctlr *ctlr, u64 route, const struct req_payload *payload,
+		     u8 pdf)
+{
+	struct ctrl_req *req;
+	int ret = -1;
+	u8 i = 0;
+
+	for (; i < ctlr->total_inflight; i++) {
+		req = ctlr->inflight[i];
+
+		if (req->route != route)
+			continue;
+
+		/* Error packets carry no sequence no., the route is all there is */
+		if ((pdf != EOF_SOF_ERROR) &&
+		    (((pdf == EOF_SOF_WRITE) != !!req->data) ||
+		    ((req->payload.seq_num != payload->seq_num) ||
+		     (req->payload.addr != payload->addr) ||
+		     (req->payload.cfg_space != payload->cfg_space) ||
+		     (req->payload.adp != payload->adp))))
+			continue;
+
+		if ((ret < 0) || (req->start < ctlr->inflight[ret]->start))
+			ret = i;
+	}
 
 	return ret;
 }
 
-/* Load the required f/w from the IMR and power on the TBT IP */
-static int tbt_hw_force_pwr(const char *pci_id, u32 val)
+/* Queues a notification for 'get_ctrl_notification', dropped if the queue is full */
+static void queue_notification(struct tbt_ctlr *ctlr, u64 route, const u32 *data,
+			       u32 len, u8 pdf)
 {
-	char *root_cmd, *bash_op;
-	char cmd[MAX_LEN];
+	struct ctrl_notification *notif;
+	u32 i = 0;
+
+	if ((ctlr->total_notifs == MAX_NOTIFICATIONS) || (len > TX_BUF_SIZE)) {
+		ctlr->req_stats.dropped_notifs++;
+		return;
+	}
+
+	notif = &ctlr->notifs[(ctlr->notif_head + ctlr->total_notifs) % MAX_NOTIFICATIONS];
+	ctlr->total_notifs++;
+
+	notif->route = route;
+	notif->pdf = pdf;
+	notif->dwords = len / 4 - 3; /* Route and CRC */
+
+	for (; i < notif->dwords; i++)
+		notif->data[i] = be32toh(data[2 + i]);
+}
+
+/* Verifies and dispatches a control packet received on RX ring 0 */
+static void handle_rx_frame(struct tbt_ctlr *ctlr, const u32 *data, u32 len, u8 pdf)
+{
+	const struct read_resp *resp = (const struct read_resp*)data;
+	struct req_payload payload = { 0 };
+	struct ctrl_req *req;
+	u32 crc, val, i;
+	u64 route;
+	int idx;
+
+	if ((len < sizeof(struct error_resp)) || (len % 4)) {
+		ctlr->req_stats.unmatched++;
+		return;
+	}
+
+	crc = ~get_crc32(~0, (const u8*)data, len - 4);
+	if (crc != be32toh(data[len / 4 - 1])) {
+		ctlr->req_stats.crc_errors++;
+		return;
+	}
+
+	route = (u64)(be32toh(resp->route_high) & ~(u32)(ROUTE_HIGH_CM)) << 32 |
+		be32toh(resp->route_low);
 
-	val &= VS_DMA_DELAY_MASK;
-	val |= 0x22 < VS_DMA_DELAY_SHIFT; /* TODO: Check the DMA delay counter value */
-	val |= VS_FORCE_PWR;
+	if ((pdf == EOF_SOF_READ) || (pdf == EOF_SOF_WRITE)) {
+		val = be32toh(data[2]);
+		memcpy(&payload, &val, sizeof(val));
+	} else if (pdf != EOF_SOF_ERROR) {
+		queue_notification(ctlr, route, data, len, pdf);
+		return;
+	}
+
+	idx = match_req(ctlr, route, &payload, pdf);
+	if (idx < 0) {
+		/* Errors not meant for any request are notifications, e.g., of an unplug */
+		if (pdf == EOF_SOF_ERROR)
+			queue_notification(ctlr, route, data, len, pdf);
+		else
+			ctlr->req_stats.unmatched++;
+
+		return;
+	}
 
-	snprintf(cmd, sizeof(cmd), "setpci -s %s 0x%x.L=0x%x", pci_id, VS_CAP_22, val);
-	root_cmd = switch_cmd_to_root(cmd);
-	bash_op = do_bash_cmd(root_cmd);
+	req = ctlr->inflight[idx];
 
-	free(root_cmd);
-	free(bash_op);
+	if (pdf == EOF_SOF_ERROR) {
+		complete_req(ctlr, idx, EIO, get_time_ns());
+		return;
+	}
+
+	/* Write responses only echo the header */
+	if (pdf == EOF_SOF_WRITE) {
+		complete_req(ctlr, idx, len == sizeof(struct read_resp) + 4 ? 0 : EPROTO,
+			     get_time_ns());
+		return;
+	}
 
-	return tbt_wait_for_pwr(pci_id);
+	/* Never copy more than the caller asked, and has room, for */
+	if ((payload.len != req->dwords) ||
+	    (len != sizeof(struct read_resp) + (payload.len + 1) * 4)) {
+		complete_req(ctlr, idx, EPROTO, get_time_ns());
+		return;
+	}
+
+	for (i = 0; i < payload.len; i++)
+		req->buf[i] = be32toh(resp->data[i]);
+
+	complete_req(ctlr, idx, 0, get_time_ns());
 }
 
-static void tbt_hw_set_ltr(const char *pci_id)
+/*
+ * Consumes all the packets received on RX ring 0, and posts their descriptors back
+ * to the h/w. The consumer index is written once for the whole batch.
+ */
+static void process_rx_ring(struct tbt_ctlr *ctlr)
 {
-	char cmd[MAX_LEN], wr_cmd[MAX_LEN];
-	char *root_cmd, *bash_op;
-	u32 val, ltr;
+	volatile struct ring_desc *desc;
+	bool consumed = false;
 
-	snprintf(cmd, sizeof(cmd), "setpci -s %s 0x%x.L", pci_id, VS_CAP_16);
-	root_cmd = switch_cmd_to_root(cmd);
-	bash_op = do_bash_cmd(root_cmd);
-	bash_op[8] = '\0';
+	for (;;) {
+		desc = (volatile struct ring_desc*)ctlr->rx_desc[ctlr->rx_index].va;
+		if (!(desc->flags & RX_DESC_DONE))
+			break;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (!(desc->flags & RX_BUF_OVF))
+			handle_rx_frame(ctlr, ctlr->rx_buf[ctlr->rx_index].va, desc->len,
+					desc->eof_pdf);
+
+		desc->flags = 0;
+		rx_index_inc(ctlr);
+
+		post_rx_desc(ctlr);
+		consumed = true;
+	}
+
+	if (consumed)
+		write_rx_cons(ctlr);
+}
+
+/*
+ * Returns a sequence no. not used by any request in flight to the given route, or
+ * -1 if all of them are.
+ */
+static int get_free_seq(struct tbt_ctlr *ctlr, u64 route)
+{
+	u8 used = 0, i = 0;
+
+	for (; i < ctlr->total_inflight; i++) {
+		if (ctlr->inflight[i]->route == route)
+			used |= 1 << ctlr->inflight[i]->payload.seq_num;
+	}
+
+	for (i = 0; i < MAX_INFLIGHT_PER_ROUTE; i++) {
+		if (!(used & (1 << i)))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Routes the interrupt of the ring at the given index (see 'RING_INT_VEC_ALLOC') to
+ * the given vector and enables it, or disables it.
+ */
+static void set_ring_irq(struct tbt_ctlr *ctlr, u32 index, u32 vec, bool enable)
+{
+	const struct vfio_hlvl_params *params = ctlr->params;
+	u64 reg = RING_INT_VEC_ALLOC + index / RING_INT_VEC_PER_REG * 4;
+	u32 shift = index % RING_INT_VEC_PER_REG * RING_INT_VEC_BITS;
+	u32 val;
+
+	val = read_host_mem_long(params, reg);
+	val &= ~(u32)(RING_INT_VEC_MASK << shift);
+	if (enable)
+		val |= vec << shift;
+	write_host_mem(params, reg, val);
+
+	reg = RING_INT_EN + index / 32 * 4;
+
+	val = read_host_mem_long(params, reg);
+	if (enable)
+		val |= BIT(index % 32);
+	else
+		val &= ~(u32)(BIT(index % 32));
+	write_host_mem(params, reg, val);
+}
+
+/* Returns whether the h/w is done loading the f/w from the IMR (VS_CAP_9) */
+static int get_fw_ready(const struct pci_cfg *cfg, bool *ready)
+{
+	u32 val;
+	int ret;
+
+	ret = pci_cfg_read_long(cfg, VS_CAP_9, &val);
+	*ready = !ret && (val & VS_FW_RDY);
+
+	return ret;
+}
+
+/*
+ * Forces the power on, with the DMA delay counter programmed (VS_CAP_22). The counter
+ * takes the same value as in the force power sequence of the Linux thunderbolt driver
+ * (icl_nhi_force_power).
+ */
+static int set_force_pwr(const struct pci_cfg *cfg)
+{
+	return pci_cfg_rmw_long(cfg, VS_CAP_22, VS_DMA_DELAY_MASK,
+				(VS_DMA_DELAY << VS_DMA_DELAY_SHIFT) | VS_FORCE_PWR);
+}
+
+/* Programs the snoop and non-snoop LTR (VS_CAP_15) with the max. one (VS_CAP_16) */
+static int set_max_ltr(const struct pci_cfg *cfg)
+{
+	u32 val;
+	int ret;
+
+	ret = pci_cfg_read_long(cfg, VS_CAP_16, &val);
+	if (ret)
+		return ret;
 
-	val = strtoud(bash_op);
 	val &= 0xffff;
-	ltr = val << 16 | val; /* Always use the max. LTR value to be safe */
 
-	free(root_cmd);
-	free(bash_op);
+	return pci_cfg_write_long(cfg, VS_CAP_15, val << 16 | val);
+}
 
-	snprintf(wr_cmd, sizeof(wr_cmd), "setpci -s %s 0x%x.L=0x%x", pci_id, VS_CAP_15, ltr);
-	root_cmd = switch_cmd_to_root(wr_cmd);
-	bash_op = do_bash_cmd(root_cmd);
+/* Accounts a bring-up in the f/w ready stats, 'lat' being unused if it timed out */
+static void record_fw_ready(u64 lat, bool timeout)
+{
+	u64 us = lat / NSEC_PER_USEC;
+	u8 bucket = 0;
 
-	free(root_cmd);
-	free(bash_op);
+	pthread_mutex_lock(&fw_stats_lock);
+
+	fw_stats.runs++;
+	if (timeout) {
+		fw_stats.timeouts++;
+		goto out;
+	}
+
+	while ((us >>= 1) && (bucket < FW_READY_HIST_BUCKETS - 1))
+		bucket++;
+
+	if (fw_stats.runs - fw_stats.timeouts == 1 || lat < fw_stats.min_ns)
+		fw_stats.min_ns = lat;
+	if (lat > fw_stats.max_ns)
+		fw_stats.max_ns = lat;
+
+	fw_stats.last_ns = lat;
+	fw_stats.total_ns += lat;
+	fw_stats.hist[bucket]++;
+
+out:
+	pthread_mutex_unlock(&fw_stats_lock);
+}
+
+/*
+ * Wait for the FW_ready bit to settle down. The f/w is usually ready in well under
+ * the deadline, hence poll with the backoff, which catches a quick one right away
+ * and sleeps more and more in between the polls of a slow one.
+ */
+static int tbt_wait_for_pwr(struct tbt_ctlr *ctlr, const struct pci_cfg *cfg)
+{
+	struct backoff b;
+	bool ready;
+	u64 lat;
+	int ret;
+
+	backoff_init(&b, ctlr->fw_ready_timeout * NSEC_PER_USEC);
+
+	do {
+		ret = get_fw_ready(cfg, &ready);
+		if (ret)
+			return ret;
+
+		if (ready) {
+			lat = get_time_ns() - b.start;
+			record_fw_ready(lat, false);
+
+			printf("FW_RDY bit is set (%" PRIu64 " us)\n", lat / NSEC_PER_USEC);
+
+			return 0;
+		}
+	} while (backoff_wait(&b));
+
+	record_fw_ready(0, true);
+
+	return ETIMEDOUT;
+}
+
+/* Load the required f/w from the IMR and power on the TBT IP */
+static int tbt_hw_force_pwr(struct tbt_ctlr *ctlr, const struct pci_cfg *cfg)
+{
+	int ret;
+
+	ret = set_force_pwr(cfg);
+	if (ret)
+		return ret;
+
+	return tbt_wait_for_pwr(ctlr, cfg);
+}
+
+/*
+ * Computes and fills the HEC of all the transport headers provided in one go.
+ * HEC covers the first three bytes of the header as transmitted (big-endian),
+ * i.e., everything except the HEC itself.
+ */
+void set_tport_headers_hec(struct tport_header *headers, u64 num)
+{
+	u8 bytes[sizeof(struct tport_header) - 1];
+	u64 i = 0;
+	u32 val;
+
+	for (; i < num; i++) {
+		memcpy(&val, &headers[i], sizeof(val));
+
+		bytes[0] = val >> 24;
+		bytes[1] = val >> 16;
+		bytes[2] = val >> 8;
+
+		headers[i].hec = get_crc8(0, bytes, sizeof(bytes));
+	}
 }
 
 /* Returns the host thunderbolt controller's PCI ID for the given domain */
 char* trim_host_pci_id(u8 domain)
 {
-	char *pci_id = malloc(MAX_LEN * sizeof(char));
-	char path[MAX_LEN];
-	char *buf;
-	u16 pos;
+	char path[MAX_LEN], link[MAX_LEN];
+	char *pci_id;
+	ssize_t len;
+	int pos;
 
 	if (total_domains() < (domain + 1)) {
 		fprintf(stderr, "invalid domain\n");
-		free(pci_id);
-
 		return NULL;
 	}
 
 	snprintf(path, sizeof(path), "%s%d-0", tbt_sysfs_path, domain);
 
-	buf = malloc(MAX_LEN * sizeof(char));
-	readlink(path, buf, MAX_LEN);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len < 0) {
+		fprintf(stderr, "failed to resolve %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	link[len] = '\0';
+
+	/* Link ends in '.../<PCI ID>/domainX/X-0' */
+	pos = strpos(link, "domain", 0);
+	if (pos < TRIM_NUM_PATH) {
+		fprintf(stderr, "no PCI device found for domain %u\n", domain);
+		return NULL;
+	}
 
-	pos = strpos(buf, "domain", 0);
 	pos -= TRIM_NUM_PATH;
 
-	strncpy(pci_id, buf + pos, TRIM_NUM_PATH - 1);
-	pci_id[TRIM_NUM_PATH] = '\0'; /*
-				       * 'strncpy' doesn't guarantee a NULL-terminated
-				       * string.
-				       */
+	pci_id = malloc(MAX_LEN * sizeof(char));
 
-	free(buf);
+	strncpy(pci_id, link + pos, TRIM_NUM_PATH - 1);
+	pci_id[TRIM_NUM_PATH - 1] = '\0'; /*
+					   * 'strncpy' doesn't guarantee a NULL-terminated
+					   * string.
+					   */
 
 	return trim_white_space(pci_id);
 }
 
 /* Reset the host-interface registers to their default values */
-void reset_host_interface(const struct vfio_hlvl_params *params)
+void reset_host_interface(struct tbt_ctlr *ctlr)
 {
-	write_host_mem(params, HOST_RESET, RESET);
+	write_host_mem(ctlr->params, HOST_RESET, RESET);
 
 	/* Host interface takes a max. of 10 ms to reset */
 	msleep(10);
 }
 
-/* Allocate the TX descriptors and reserve the DMA memory */
-void allocate_tx_desc(const struct vfio_hlvl_params *params)
+/* Creates the DMA arena on the first use */
+static int get_dma_arena(struct tbt_ctlr *ctlr)
+{
+	if (ctlr->arena)
+		return 0;
+
+	ctlr->arena = dma_arena_create(ctlr->params, DMA_ARENA_SIZE);
+	if (!ctlr->arena) {
+		fprintf(stderr, "failed to create the DMA arena\n");
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Carves a ring of the given no. of descriptors out of the DMA arena. The host
+ * interface expects the descriptors of a ring to be contiguous from its base address.
+ */
+static int allocate_ring(struct tbt_ctlr *ctlr, struct va_phy_addr *ring, u8 size)
 {
-	struct vfio_iommu_type1_dma_map *dma_map;
+	struct ring_desc *descs;
+	u64 iova;
 	u8 i = 0;
+	int ret;
+
+	ret = get_dma_arena(ctlr);
+	if (ret)
+		return ret;
+
+	descs = dma_arena_alloc(ctlr->arena, size * sizeof(struct ring_desc), PAGE_SIZE,
+				&iova);
+	if (!descs) {
+		fprintf(stderr, "DMA arena exhausted\n");
+		return ENOMEM;
+	}
+
+	for (; i < size; i++) {
+		ring[i].dma_map = NULL;
+		ring[i].va = &descs[i];
+		ring[i].iova = iova + i * sizeof(struct ring_desc);
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate the TX descriptors and reserve the DMA memory.
+ * Every descriptor gets its own control packet buffer from the arena up front, so
+ * that posting a request doesn't need any mapping.
+ */
+int allocate_tx_desc(struct tbt_ctlr *ctlr)
+{
+	struct ring_desc *desc;
+	u8 *bufs;
+	u64 iova;
+	u8 i = 0;
+	int ret;
 
 	printf("allocating and mapping %u DMA TX descriptors\n", TX_SIZE);
+
+	ret = allocate_ring(ctlr, ctlr->tx_desc, TX_SIZE);
+	if (ret)
+		return ret;
+
+	bufs = dma_arena_alloc(ctlr->arena, TX_SIZE * TX_BUF_SIZE, TX_BUF_SIZE, &iova);
+	if (!bufs) {
+		fprintf(stderr, "DMA arena exhausted\n");
+		return ENOMEM;
+	}
+
 	for (; i < TX_SIZE; i++) {
-		dma_map = iommu_map_va(params->container, RDWR_FLAG, page_index++);
+		ctlr->tx_buf[i].dma_map = NULL;
+		ctlr->tx_buf[i].va = bufs + i * TX_BUF_SIZE;
+		ctlr->tx_buf[i].iova = iova + i * TX_BUF_SIZE;
 
-		tx_desc[i].dma_map = dma_map;
-		tx_desc[i].va = (void*)dma_map->vaddr;
-		tx_desc[i].iova = dma_map->iova;
+		desc = (struct ring_desc*)ctlr->tx_desc[i].va;
+		desc->addr_low = ctlr->tx_buf[i].iova & BITMASK(31, 0);
+		desc->addr_high = (ctlr->tx_buf[i].iova & BITMASK(63, 32)) >> 32;
 	}
+
+	return 0;
 }
 
-/* Allocate the RX descriptors and reserve the DMA memory */
-void allocate_rx_desc(const struct vfio_hlvl_params *params)
+/*
+ * Allocate the RX descriptors and reserve the DMA memory.
+ * Every descriptor gets its own data buffer from the arena, and all but one of them
+ * are posted to the h/w right away.
+ */
+int allocate_rx_desc(struct tbt_ctlr *ctlr)
 {
-	struct vfio_iommu_type1_dma_map *dma_map;
+	struct ring_desc *desc;
+	u8 *bufs;
+	u64 iova;
 	u8 i = 0;
+	int ret;
 
 	printf("allocating and mapping %u DMA RX descriptors\n", RX_SIZE);
+
+	ret = allocate_ring(ctlr, ctlr->rx_desc, RX_SIZE);
+	if (ret)
+		return ret;
+
+	bufs = dma_arena_alloc(ctlr->arena, RX_SIZE * RX_BUF_SIZE, RX_BUF_SIZE, &iova);
+	if (!bufs) {
+		fprintf(stderr, "DMA arena exhausted\n");
+		return ENOMEM;
+	}
+
 	for (; i < RX_SIZE; i++) {
-		dma_map = iommu_map_va(params->container, RDWR_FLAG, page_index++);
+		ctlr->rx_buf[i].dma_map = NULL;
+		ctlr->rx_buf[i].va = bufs + i * RX_BUF_SIZE;
+		ctlr->rx_buf[i].iova = iova + i * RX_BUF_SIZE;
 
-		rx_desc[i].dma_map = dma_map;
-		rx_desc[i].va = (void*)dma_map->vaddr;
-		rx_desc[i].iova = dma_map->iova;
+		desc = (struct ring_desc*)ctlr->rx_desc[i].va;
+		desc->addr_low = ctlr->rx_buf[i].iova & BITMASK(31, 0);
+		desc->addr_high = (ctlr->rx_buf[i].iova & BITMASK(63, 32)) >> 32;
 	}
+
+	ctlr->rx_index = 0;
+	ctlr->rx_head = 0;
+
+	for (i = 0; i < RX_SIZE - 1; i++)
+		post_rx_desc(ctlr);
+
+	return 0;
 }
 
 /*
@@ -332,15 +858,16 @@ void allocate_rx_desc(const struct vfio_hlvl_params *params)
  * Ring size is coded with a total of 16 descriptors, to make it equal to
  * the RX ring size.
  */
-void init_host_tx(const struct vfio_hlvl_params *params)
+void init_host_tx(struct tbt_ctlr *ctlr)
 {
+	const struct vfio_hlvl_params *params = ctlr->params;
 	u32 val = 0;
 
 	printf("initializing host-interface config. for TX\n");
 
-	write_host_mem(params, TX_BASE_LOW, tx_desc[0].iova & BITMASK(31,0));
-	write_host_mem(params, TX_BASE_HIGH, (tx_desc[0].iova & BITMASK(63, 32)) >> 32);
-	write_host_mem(params, TX_PROD_CONS_INDEX, 0);
+	write_host_mem(params, TX_BASE_LOW, ctlr->tx_desc[0].iova & BITMASK(31,0));
+	write_host_mem(params, TX_BASE_HIGH, (ctlr->tx_desc[0].iova & BITMASK(63, 32)) >> 32);
+	tx_start(ctlr); /* Nothing posted yet, i.e., producer index at 'tx_index' = 0 */
 	write_host_mem(params, TX_RING_SIZE, TX_SIZE); /* Optimum no. of descriptors? */
 
 	val |= TX_RAW | TX_VALID;
@@ -353,15 +880,18 @@ void init_host_tx(const struct vfio_hlvl_params *params)
  * Data buffer size of the RX layer needs to be set with the no. of bytes to be posted in
  * the host memory. For now, program it to '0' to represent a max. of 4096 bytes.
  */
-void init_host_rx(const struct vfio_hlvl_params *params)
+void init_host_rx(struct tbt_ctlr *ctlr)
 {
+	const struct vfio_hlvl_params *params = ctlr->params;
 	u32 val = 0;
 
 	printf("initializing host-interface config. for RX\n");
 
-	write_host_mem(params, RX_BASE_LOW, rx_desc[0].iova & BITMASK(31, 0));
-	write_host_mem(params, RX_BASE_HIGH, (rx_desc[0].iova & BITMASK(63, 32)) >> 32);
-	write_host_mem(params, RX_PROD_CONS_INDEX, 0);
+	write_host_mem(params, RX_BASE_LOW, ctlr->rx_desc[0].iova & BITMASK(31, 0));
+	write_host_mem(params, RX_BASE_HIGH, (ctlr->rx_desc[0].iova & BITMASK(63, 32)) >> 32);
+
+	/* Buffers pre-posted in 'allocate_rx_desc' are handed over via the consumer index */
+	write_rx_cons(ctlr);
 
 	/*
 	 * Optimum no. of descriptors: 256 (min. bytes required) / 16 (bytes in a
@@ -370,87 +900,635 @@ void init_host_rx(const struct vfio_hlvl_params *params)
 	 */
 	write_host_mem(params, RX_RING_BUF_SIZE, RX_SIZE);
 
+	/* Accept the control packets of all the PDFs */
+	write_host_mem(params, RX_RING_PDF, RX_SOF_PDF | RX_EOF_PDF);
+
 	val |= RX_RAW | RX_VALID;
 	write_host_mem(params, RX_RING_CTRL, val);
 }
 
+/*
+ * Posts as many of the given requests (reads, or writes if 'data' is set) as
+ * possible, in order, and starts them all with a single doorbell. A request can't be
+ * posted while the TX ring is full, or if all the sequence no.s of its route are in
+ * use (max. 4 requests in flight to a router). A request of no dwords, or of more
+ * than 'MAX_CTRL_DWORDS', is done right away with 'EINVAL', without being posted.
+ * Returns the no. of requests taken, i.e., posted or failed; the rest are to be
+ * submitted again once some complete. Requests, and their buffers, must stay valid
+ * until they are done.
+ */
+u32 submit_ctrl_reqs(struct tbt_ctlr *ctlr, struct ctrl_req *reqs, u32 num)
+{
+	u64 now = get_time_ns();
+	u8 slots = tx_free_slots(ctlr, now);
+	struct ctrl_req *req;
+	u32 i = 0, posted = 0;
+	int seq;
+
+	for (; (i < num) && slots && (ctlr->total_inflight < MAX_INFLIGHT); i++) {
+		req = &reqs[i];
+
+		/* Length is 6 bits in the payload, and a packet is to fit in its TX buffer */
+		if (!req->dwords || (req->dwords > MAX_CTRL_DWORDS)) {
+			req->status = EINVAL;
+			req->latency_ns = 0;
+			__atomic_store_n(&req->done, true, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		seq = get_free_seq(ctlr, req->route);
+		if (seq < 0)
+			break;
+
+		req->payload = make_req_payload(req->addr, req->dwords, req->adp,
+						req->cfg_space);
+		req->payload.seq_num = seq;
+		req->status = 0;
+		req->done = false;
+		req->start = now;
+
+		ctlr->tx_posted[ctlr->tx_index] = now;
+
+		if (req->data)
+			make_tx_write_req(ctlr, req->route, &req->payload, req->data);
+		else
+			make_tx_read_req(ctlr, req->route, &req->payload);
+
+		ctlr->inflight[ctlr->total_inflight++] = req;
+		posted++;
+		slots--;
+	}
+
+	if (!posted)
+		return i;
+
+	/* Descriptors must be visible to the h/w before the doorbell */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	tx_start(ctlr);
+
+	return i;
+}
+
+/*
+ * Collects the responses received so far, and fails the requests past their
+ * deadline.
+ * Returns the no. of requests completed.
+ */
+u32 complete_ctrl_reqs(struct tbt_ctlr *ctlr)
+{
+	u8 before = ctlr->total_inflight, i = 0;
+	u64 now;
+
+	process_rx_ring(ctlr);
+
+	now = get_time_ns();
+
+	while (i < ctlr->total_inflight) {
+		if (now - ctlr->inflight[i]->start > ctlr->ctrl_timeout * NSEC_PER_USEC)
+			complete_req(ctlr, i, ETIMEDOUT, now);
+		else
+			i++;
+	}
+
+	return before - ctlr->total_inflight;
+}
+
+/*
+ * Runs the given requests to completion, keeping the TX ring as full as the limits
+ * allow so that the round trips to the different routers overlap. Responses are
+ * returned in the respective requests, whatever order they arrive in.
+ * Requests which couldn't even be posted by the deadline fail with 'ETIMEDOUT'.
+ * Returns 0 if all the requests succeeded, else the status of the first failed one.
+ */
+int run_ctrl_reqs(struct tbt_ctlr *ctlr, struct ctrl_req *reqs, u32 num)
+{
+	struct backoff b;
+	u32 sent = 0, i;
+
+	backoff_init(&b, ctlr->ctrl_timeout * NSEC_PER_USEC);
+
+	while ((sent < num) || ctlr->total_inflight) {
+		i = 0;
+
+		if (sent < num)
+			i = submit_ctrl_reqs(ctlr, reqs + sent, num - sent);
+		sent += i;
+
+		if (complete_ctrl_reqs(ctlr) || i) {
+			backoff_init(&b, ctlr->ctrl_timeout * NSEC_PER_USEC);
+			continue;
+		}
+
+		if (ring_wait(ctlr, &b) || ctlr->total_inflight)
+			continue;
+
+		/* Nothing in flight, and no TX slot freed up for the rest */
+		for (; sent < num; sent++) {
+			reqs[sent].status = ETIMEDOUT;
+			reqs[sent].done = true;
+			ctlr->req_stats.timeouts++;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		if (reqs[i].status)
+			return reqs[i].status;
+	}
+
+	return 0;
+}
+
+/*
+ * Splits the given config. space range into maximum-length control packets, reading
+ * into 'out' or writing from 'in', and runs them all.
+ */
+static int run_cfg_range(struct tbt_ctlr *ctlr, u64 route, u8 space,
+			 u8 adp, u32 addr, u32 ndwords, u32 *out, const u32 *in)
+{
+	u32 num = (ndwords + MAX_CTRL_DWORDS - 1) / MAX_CTRL_DWORDS;
+	struct ctrl_req *reqs;
+	u32 i = 0;
+	int ret;
+
+	if (!ndwords || (addr + ndwords > MAX_CFG_DWORDS) || (space > CNTR_CFG) ||
+	    (adp >= MAX_ADPS))
+		return EINVAL;
+
+	reqs = calloc(num, sizeof(struct ctrl_req));
+	if (!reqs)
+		return ENOMEM;
+
+	for (; i < num; i++) {
+		reqs[i].route = route;
+		reqs[i].cfg_space = space;
+		reqs[i].adp = adp;
+		reqs[i].addr = addr + i * MAX_CTRL_DWORDS;
+		reqs[i].dwords = i == num - 1 ? ndwords - i * MAX_CTRL_DWORDS : MAX_CTRL_DWORDS;
+
+		if (in)
+			reqs[i].data = in + i * MAX_CTRL_DWORDS;
+		else
+			reqs[i].buf = out + i * MAX_CTRL_DWORDS;
+	}
+
+	ret = run_ctrl_reqs(ctlr, reqs, num);
+
+	free(reqs);
+
+	return ret;
+}
+
+/*
+ * Reads 'ndwords' dwords of the given config. space of the router at the given route,
+ * starting at the dword address 'addr', into 'out'. For adapter and path config.
+ * spaces, 'adp' selects the adapter (max. 63).
+ * The range is split into maximum-length control packets, which are pipelined and
+ * reassembled in 'out'.
+ */
+int read_cfg_range(struct tbt_ctlr *ctlr, u64 route, u8 space, u8 adp,
+		   u32 addr, u32 ndwords, u32 *out)
+{
+	return run_cfg_range(ctlr, route, space, adp, addr, ndwords, out, NULL);
+}
+
+/* Writes 'ndwords' dwords from 'in', the counterpart of 'read_cfg_range' */
+int write_cfg_range(struct tbt_ctlr *ctlr, u64 route, u8 space, u8 adp,
+		    u32 addr, u32 ndwords, const u32 *in)
+{
+	return run_cfg_range(ctlr, route, space, adp, addr, ndwords, NULL, in);
+}
+
+/*
+ * Queues a write of 'dwords' dwords of 'data' (max. 'MAX_CTRL_DWORDS') in the given
+ * request, to be submitted along with others via 'submit_ctrl_reqs' or
+ * 'run_ctrl_reqs', e.g., to update the same register across all the lane adapters
+ * with a single doorbell. Status of each write is returned in its request.
+ * Returns 0 on success, else 'EINVAL' if 'dwords' is out of range, in which case the
+ * request is done already with the same status.
+ */
+int init_write_req(struct ctrl_req *req, u64 route, u8 space, u8 adp, u32 addr,
+		   u8 dwords, const u32 *data)
+{
+	memset(req, 0, sizeof(struct ctrl_req));
+
+	req->route = route;
+	req->cfg_space = space;
+	req->adp = adp;
+	req->addr = addr;
+	req->dwords = dwords;
+	req->data = data;
+
+	if (!dwords || (dwords > MAX_CTRL_DWORDS)) {
+		req->status = EINVAL;
+		req->done = true;
+
+		return EINVAL;
+	}
+
+	return 0;
+}
+
 /*
  * Request router config. space of the router at the provided route for the given no.
- * of dwords.
+ * of dwords, which are returned in 'buf'.
  */
-int request_router_cfg(const char *pci_id, const struct vfio_hlvl_params *params,
-		       u64 route, u32 addr, u64 dwords)
+int request_router_cfg(struct tbt_ctlr *ctlr, u64 route, u32 addr, u64 dwords,
+		       u32 *buf)
 {
-	struct req_payload *payload = make_req_payload(addr, dwords, 0, ROUTER_CFG);
-	struct vfio_iommu_type1_dma_map *dma_map = NULL;
-	struct ring_desc *tx_desc;
-	/* Not needed for transmission */
-	//struct ring_desc *rx_desc = make_rx_read_resp(params);
-	int ret = 0;
+	int ret;
+
+	ret = read_cfg_range(ctlr, route, ROUTER_CFG, 0, addr, dwords, buf);
+	if (ret) {
+		fprintf(stderr, "read request failed: %s\n", strerror(ret));
+		return ret;
+	}
+
+	printf("read response received (%" PRIu64 " ns)\n", ctlr->req_stats.last_ns);
+
+	return 0;
+}
+
+/*
+ * Switches the completions of ring 0 to the interrupt mode: enables the MSI-X vectors
+ * of the device, routes TX and RX ring 0 to them and marks the descriptors posted
+ * from now on to raise an interrupt once done.
+ * The callers can then sleep in 'wait_for_ring_event', or add the fd returned by
+ * 'get_ring_event_fd' to their own epoll loop, instead of polling.
+ */
+int enable_ring_irqs(struct tbt_ctlr *ctlr)
+{
+	struct vfio_hlvl_params *params = ctlr->params;
+	struct epoll_event ev = { .events = EPOLLIN };
+	u32 i = 0, val;
+	int ret;
+
+	ret = enable_dev_irqs(params, RX_RING_VEC + 1);
+	if (ret) {
+		fprintf(stderr, "failed to enable the MSI-X vectors: %s\n", strerror(ret));
+		return ret;
+	}
+
+	ctlr->irq_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctlr->irq_epfd < 0) {
+		ret = errno;
+		disable_dev_irqs(params);
+
+		return ret;
+	}
+
+	for (; i < params->total_irqs; i++) {
+		ev.data.fd = params->irq_fds[i];
+		if (epoll_ctl(ctlr->irq_epfd, EPOLL_CTL_ADD, params->irq_fds[i], &ev)) {
+			ret = errno;
+			fprintf(stderr, "failed to watch the MSI-X vector %u: %s\n", i,
+				strerror(ret));
+
+			close(ctlr->irq_epfd);
+			ctlr->irq_epfd = -1;
+			disable_dev_irqs(params);
 
-	tx_desc = make_tx_read_req(params, route, payload, &dma_map);
+			return ret;
+		}
 
-	allow_bus_master(pci_id);
+		ctlr->ring_vec_fds[i] = params->irq_fds[i];
+	}
 
-	tx_start(params);
-	usleep(CTRL_TIMEOUT);
+	ctlr->total_ring_vecs = params->total_irqs;
+	ctlr->rx_ring_index = read_host_mem_long(params, HOST_CAPS) & TOTAL_PATHS;
 
 	/*
-	 * Host interface layer of the router will set the 'TX_DESC_DONE' flag in the
-	 * TX descriptor stored in the host memory if successful transmission has
-	 * occured. Hence, verify it via reading the flag.
+	 * Vectors already identify the rings, let the h/w clear the status bits. The
+	 * original value is restored once the interrupts are disabled.
 	 */
-	if (!(tx_desc->flags & TX_DESC_DONE)) {
-		fprintf(stderr, "transport layer failed to receive the control packet\n");
-		ret = 1;
+	val = read_host_mem_long(params, HOST_CTRL);
+	ctlr->host_ctrl = val;
+	val |= INT_AUTO_CLR;
+	val &= ~(u32)(DISABLE_ISR_AUTO_CLR);
+	write_host_mem(params, HOST_CTRL, val);
 
-		goto free;
-	} else
-		printf("read request successfully posted to the transport layer\n");
+	set_ring_irq(ctlr, 0, TX_RING_VEC, true);
+	set_ring_irq(ctlr, ctlr->rx_ring_index,
+		     ctlr->total_ring_vecs > RX_RING_VEC ? RX_RING_VEC : TX_RING_VEC, true);
 
-free:
-	free(payload);
-	free_dma_map(params->container, dma_map);
+	return 0;
+}
 
-	return ret;
+/* Switches ring 0 back to the polling mode */
+void disable_ring_irqs(struct tbt_ctlr *ctlr)
+{
+	if (ctlr->irq_epfd < 0)
+		return;
+
+	set_ring_irq(ctlr, 0, 0, false);
+	set_ring_irq(ctlr, ctlr->rx_ring_index, 0, false);
+	write_host_mem(ctlr->params, HOST_CTRL, ctlr->host_ctrl);
+
+	close(ctlr->irq_epfd);
+	ctlr->irq_epfd = -1;
+	ctlr->total_ring_vecs = 0;
+
+	disable_dev_irqs(ctlr->params);
 }
 
-int tbt_hw_init(const char *pci_id)
+/* Returns the fd to poll for the ring events, -1 if not in the interrupt mode */
+int get_ring_event_fd(const struct tbt_ctlr *ctlr)
 {
-	char *root_cmd, *bash_op;
-	char cmd[MAX_LEN];
-	int ret = 0;
-	u32 val;
+	return ctlr->irq_epfd;
+}
 
-	snprintf(cmd, sizeof(cmd), "setpci -s %s 0x%x.L", pci_id, VS_CAP_22);
-	root_cmd = switch_cmd_to_root(cmd);
-	bash_op = do_bash_cmd(root_cmd);
-	bash_op = trim_white_space(bash_op);
+/*
+ * Waits up to 'timeout_ms' (-1 for no timeout) for the ring 0 interrupts, and acks
+ * them. 'rings' returns the mask of the rings signalled ('RING_EVENT_TX' and/or
+ * 'RING_EVENT_RX'), 0 if timed out.
+ * Ring interrupts only hint that the descriptors need to be looked at, which are the
+ * source of truth, hence consuming an event meant for another waiter is harmless.
+ */
+int wait_for_ring_event(struct tbt_ctlr *ctlr, int timeout_ms, u32 *rings)
+{
+	struct epoll_event evs[RX_RING_VEC + 1];
+	int i = 0, num;
+	u64 cnt;
+
+	*rings = 0;
+
+	if (ctlr->irq_epfd < 0)
+		return ENODEV;
+
+	num = epoll_wait(ctlr->irq_epfd, evs, RX_RING_VEC + 1, timeout_ms);
+	if (num < 0)
+		return errno;
+
+	for (; i < num; i++) {
+		/* Eventfds are non-blocking, and the count is of no use */
+		if (read(evs[i].data.fd, &cnt, sizeof(cnt)) < 0)
+			continue;
+
+		/* Both the rings share the TX vector if there's only one */
+		if (ctlr->total_ring_vecs <= RX_RING_VEC)
+			*rings |= RING_EVENT_TX | RING_EVENT_RX;
+		else if (evs[i].data.fd == ctlr->ring_vec_fds[RX_RING_VEC])
+			*rings |= RING_EVENT_RX;
+		else
+			*rings |= RING_EVENT_TX;
+	}
+
+	return 0;
+}
+
+/*
+ * Fetches the oldest notification received on RX ring 0, e.g., a hot-plug event.
+ * The RX ring is looked at first, hence this can be called straight from the event
+ * loop once 'wait_for_ring_event' (or the fd of 'get_ring_event_fd') signals RX.
+ * Notifications are kept until fetched, up to 'MAX_NOTIFICATIONS'.
+ * Returns 0 on success, else ENOENT if there's none.
+ */
+int get_ctrl_notification(struct tbt_ctlr *ctlr, struct ctrl_notification *notif)
+{
+	process_rx_ring(ctlr);
 
-	val = strtouh(bash_op);
-	ret = tbt_hw_force_pwr(pci_id, val);
+	if (!ctlr->total_notifs)
+		return ENOENT;
+
+	*notif = ctlr->notifs[ctlr->notif_head];
+	ctlr->notif_head = (ctlr->notif_head + 1) % MAX_NOTIFICATIONS;
+	ctlr->total_notifs--;
+
+	return 0;
+}
+
+/* Sets the deadline (us) of the control requests, 0 restores the default */
+void set_ctrl_timeout(struct tbt_ctlr *ctlr, u64 timeout_us)
+{
+	ctlr->ctrl_timeout = timeout_us ? timeout_us : CTRL_TIMEOUT;
+}
+
+/* Returns the completion stats of the control requests issued so far */
+void get_ctrl_req_stats(const struct tbt_ctlr *ctlr, struct ctrl_req_stats *stats)
+{
+	*stats = ctlr->req_stats;
+}
+
+/* Sets the deadline (us) of the f/w getting ready, 0 restores the default */
+void set_fw_ready_timeout(struct tbt_ctlr *ctlr, u64 timeout_us)
+{
+	ctlr->fw_ready_timeout = timeout_us ? timeout_us : FW_READY_TIMEOUT;
+}
+
+/* Returns the f/w ready latencies of the h/w bring-ups of all the controllers so far */
+void get_fw_ready_stats(struct fw_ready_stats *stats)
+{
+	pthread_mutex_lock(&fw_stats_lock);
+	*stats = fw_stats;
+	pthread_mutex_unlock(&fw_stats_lock);
+}
+
+/* Prints the f/w ready latency summary and the non-empty histogram buckets */
+void print_fw_ready_stats(void)
+{
+	struct fw_ready_stats stats;
+	u64 ok;
+	u8 i = 0;
+
+	get_fw_ready_stats(&stats);
+	ok = stats.runs - stats.timeouts;
+
+	printf("FW ready: %" PRIu64 " runs, %" PRIu64 " timeouts\n", stats.runs,
+	       stats.timeouts);
+	if (!ok)
+		return;
+
+	printf("latency (us): min %" PRIu64 ", avg %" PRIu64 ", max %" PRIu64 "\n",
+	       stats.min_ns / NSEC_PER_USEC, stats.total_ns / ok / NSEC_PER_USEC,
+	       stats.max_ns / NSEC_PER_USEC);
+
+	for (; i < FW_READY_HIST_BUCKETS; i++) {
+		if (stats.hist[i])
+			printf("  [%8" PRIu64 ", %8" PRIu64 ") us: %" PRIu64 "\n",
+			       i ? (u64)1 << i : 0, (u64)1 << (i + 1), stats.hist[i]);
+	}
+}
+
+/*
+ * Powers on the TBT h/w and enables it for DMA. PCI config. space is accessed via the
+ * VFIO device of the controller if it's set up, else via sysfs.
+ */
+int tbt_hw_init(struct tbt_ctlr *ctlr)
+{
+	struct pci_cfg cfg;
+	int ret;
+
+	ret = open_pci_cfg(&cfg, ctlr->pci_id, ctlr->params);
+	if (ret) {
+		fprintf(stderr, "failed to open the PCI config. space: %s\n", strerror(ret));
+		return ret;
+	}
+
+	ret = tbt_hw_force_pwr(ctlr, &cfg);
 	if (ret) {
 		fprintf(stderr, "timeout in powering on the TBT h/w\n");
 		goto out;
 	}
 
-	tbt_hw_set_ltr(pci_id);
+	ret = set_max_ltr(&cfg);
+	if (!ret)
+		ret = allow_bus_master(&cfg);
+	if (ret)
+		fprintf(stderr, "failed to configure the TBT h/w: %s\n", strerror(ret));
 
 out:
-	free(root_cmd);
-	free(bash_op);
+	close_pci_cfg(&cfg);
 
 	return ret;
 }
 
-/* Free the allocated DMA mapping of the descriptors */
-void free_tx_rx_desc(const struct vfio_hlvl_params *params)
+/* Returns whether the h/w has consumed all the TX descriptors posted */
+static bool tx_idle(const struct tbt_ctlr *ctlr)
 {
-	u8 i = 0;
+	const struct vfio_hlvl_params *params = ctlr->params;
+
+	return (read_host_mem_long(params, TX_PROD_CONS_INDEX) & TX_CONS_INDEX) ==
+	       ctlr->tx_index;
+}
+
+/*
+ * Stops ring 0 before its memory goes away: waits for the h/w to consume the TX
+ * descriptors posted, clears the valid bits and waits for them to read back clear.
+ * Both waits are bounded by the deadline of a request, a ring not getting idle by
+ * then is stopped anyway.
+ */
+static void stop_rings(struct tbt_ctlr *ctlr)
+{
+	const struct vfio_hlvl_params *params = ctlr->params;
+	struct backoff b;
+	u32 val;
+
+	backoff_init(&b, ctlr->ctrl_timeout * NSEC_PER_USEC);
+
+	do {
+		if (tx_idle(ctlr))
+			break;
+	} while (backoff_wait(&b));
+
+	val = read_host_mem_long(params, TX_RING_CTRL);
+	write_host_mem(params, TX_RING_CTRL, val & ~(u32)(TX_VALID));
+
+	val = read_host_mem_long(params, RX_RING_CTRL);
+	write_host_mem(params, RX_RING_CTRL, val & ~(u32)(RX_VALID));
+
+	backoff_init(&b, ctlr->ctrl_timeout * NSEC_PER_USEC);
+
+	do {
+		if (!(read_host_mem_long(params, TX_RING_CTRL) & TX_VALID) &&
+		    !(read_host_mem_long(params, RX_RING_CTRL) & RX_VALID))
+			break;
+	} while (backoff_wait(&b));
+
+	if (!tx_idle(ctlr))
+		fprintf(stderr, "ring 0 stopped with TX descriptors pending\n");
+}
+
+/* Free the allocated DMA mapping of the descriptors, once ring 0 is stopped */
+void free_tx_rx_desc(struct tbt_ctlr *ctlr)
+{
+	if (ctlr->arena)
+		stop_rings(ctlr);
+
+	dma_arena_destroy(ctlr->params, ctlr->arena);
+	ctlr->arena = NULL;
+
+	memset(ctlr->tx_desc, 0, sizeof(ctlr->tx_desc));
+	memset(ctlr->rx_desc, 0, sizeof(ctlr->rx_desc));
+	memset(ctlr->tx_buf, 0, sizeof(ctlr->tx_buf));
+	memset(ctlr->rx_buf, 0, sizeof(ctlr->rx_buf));
+	ctlr->tx_index = 0;
+	ctlr->tx_clean = 0;
+	ctlr->rx_index = 0;
+	ctlr->rx_head = 0;
+}
+
+/*
+ * Opens the host thunderbolt controller of the given domain: binds the modules of
+ * its IOMMU group to VFIO, powers on the h/w and sets up the ring 0.
+ * A controller owns all its state, hence different controllers can be driven from
+ * different threads without any locking, while a controller is to be driven from
+ * one thread at a time. A VFIO group can be open only once, hence a controller in the
+ * same IOMMU group as an already open one fails to open (EBUSY) without disturbing it.
+ * 'check_vfio_module' is to be called once before.
+ * Returns NULL on failure.
+ */
+struct tbt_ctlr* tbt_ctlr_open(u8 domain)
+{
+	struct tbt_ctlr *ctlr = calloc(1, sizeof(struct tbt_ctlr));
+	int ret;
+
+	if (!ctlr)
+		return NULL;
+
+	ctlr->irq_epfd = -1;
+	ctlr->ctrl_timeout = CTRL_TIMEOUT;
+	ctlr->fw_ready_timeout = FW_READY_TIMEOUT;
+
+	ctlr->pci_id = trim_host_pci_id(domain);
+	if (!ctlr->pci_id)
+		goto err;
+
+	/* Bind all the modules present in the same IOMMU group as the PCI device */
+	ctlr->dev_list = bind_grp_modules(ctlr->pci_id, &ctlr->total_modules);
+
+	ctlr->params = vfio_dev_init(ctlr->pci_id);
+	if (!ctlr->params)
+		goto err;
+
+	get_dev_bar_regions(ctlr->params);
+	get_dev_pci_cfg_region(ctlr->params);
+
+	reset_host_interface(ctlr);
+
+	ret = tbt_hw_init(ctlr);
+	if (!ret)
+		ret = allocate_tx_desc(ctlr);
+	if (!ret)
+		ret = allocate_rx_desc(ctlr);
+	if (ret)
+		goto err;
+
+	init_host_tx(ctlr);
+	init_host_rx(ctlr);
+
+	return ctlr;
+
+err:
+	tbt_ctlr_close(ctlr);
+
+	return NULL;
+}
+
+/* Tears down everything set up by 'tbt_ctlr_open', and frees the controller */
+void tbt_ctlr_close(struct tbt_ctlr *ctlr)
+{
+	struct vfio_hlvl_params *params = ctlr->params;
+
+	if (params) {
+		disable_ring_irqs(ctlr);
+		free_tx_rx_desc(ctlr);
+
+		free(params->dev_info);
+		free_dev_bar_regions(params);
+		free(params->pci_cfg_region);
+		iova_allocator_destroy(params->iova);
+		free(params->iommu.ranges);
+
+		close(params->device);
+		close(params->container);
+		close(params->group);
+
+		free(params);
+	}
 
-	for (; i < TX_SIZE; i++)
-		free_dma_map(params->container, tx_desc[i].dma_map);
+	if (ctlr->dev_list)
+		unbind_grp_modules(ctlr->dev_list, ctlr->total_modules);
 
-	for (i = 0; i < RX_SIZE; i++)
-		free_dma_map(params->container, rx_desc[i].dma_map);
+	free(ctlr->pci_id);
+	free(ctlr);
 }
@@ -7,13 +7,36 @@
 
 #include "tb_cfg.h"
 
+u8 total_domains(void);
+void set_tport_headers_hec(struct tport_header *headers, u64 num);
 char* trim_host_pci_id(u8 domain);
-void reset_host_interface(const struct vfio_hlvl_params *params);
-void allocate_tx_desc(const struct vfio_hlvl_params *params);
-void allocate_rx_desc(const struct vfio_hlvl_params *params);
-void init_host_tx(const struct vfio_hlvl_params *params);
-void init_host_rx(const struct vfio_hlvl_params *params);
-int request_router_cfg(const char *pci_id, const struct vfio_hlvl_params *params,
-		       u64 route, u32 addr, u64 dwords);
-int tbt_hw_init(const char *pci_id);
-void free_tx_rx_desc(const struct vfio_hlvl_params *params);
+struct tbt_ctlr* tbt_ctlr_open(u8 domain);
+void tbt_ctlr_close(struct tbt_ctlr *ctlr);
+void reset_host_interface(struct tbt_ctlr *ctlr);
+int allocate_tx_desc(struct tbt_ctlr *ctlr);
+int allocate_rx_desc(struct tbt_ctlr *ctlr);
+void init_host_tx(struct tbt_ctlr *ctlr);
+void init_host_rx(struct tbt_ctlr *ctlr);
+u32 submit_ctrl_reqs(struct tbt_ctlr *ctlr, struct ctrl_req *reqs, u32 num);
+u32 complete_ctrl_reqs(struct tbt_ctlr *ctlr);
+int run_ctrl_reqs(struct tbt_ctlr *ctlr, struct ctrl_req *reqs, u32 num);
+int read_cfg_range(struct tbt_ctlr *ctlr, u64 route, u8 space, u8 adp, u32 addr,
+		   u32 ndwords, u32 *out);
+int write_cfg_range(struct tbt_ctlr *ctlr, u64 route, u8 space, u8 adp, u32 addr,
+		    u32 ndwords, const u32 *in);
+int init_write_req(struct ctrl_req *req, u64 route, u8 space, u8 adp, u32 addr,
+		   u8 dwords, const u32 *data);
+int request_router_cfg(struct tbt_ctlr *ctlr, u64 route, u32 addr, u64 dwords,
+		       u32 *buf);
+int enable_ring_irqs(struct tbt_ctlr *ctlr);
+void disable_ring_irqs(struct tbt_ctlr *ctlr);
+int get_ring_event_fd(const struct tbt_ctlr *ctlr);
+int wait_for_ring_event(struct tbt_ctlr *ctlr, int timeout_ms, u32 *rings);
+int get_ctrl_notification(struct tbt_ctlr *ctlr, struct ctrl_notification *notif);
+void set_ctrl_timeout(struct tbt_ctlr *ctlr, u64 timeout_us);
+void get_ctrl_req_stats(const struct tbt_ctlr *ctlr, struct ctrl_req_stats *stats);
+void set_fw_ready_timeout(struct tbt_ctlr *ctlr, u64 timeout_us);
+void get_fw_ready_stats(struct fw_ready_stats *stats);
+void print_fw_ready_stats(void);
+int tbt_hw_init(struct tbt_ctlr *ctlr);
+void free_tx_rx_desc(struct tbt_ctlr *ctlr);
@@ -12,80 +12,233 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
+#include <endian.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <cpuid.h>
+#define CRC32_HW
+#elif defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#define CRC32_HW
+#endif
 
 #include "utils.h"
 
-#define GET_ALIGNED_PAGE(x, a)		_GET_ALIGNED_PAGE(x, (typeof(x))(a) - 1)
-#define _GET_ALIGNED_PAGE(x, a)		(((x) + (a)) & ~(a))
-
-/* Control packets */
+/* Control packets (CRC32C) */
 #define CRC32_POLY_LE			0x82f63b78
+#define CRC32_CHECK			0xe3069283 /* CRC of "123456789" */
+
+/* Polling backoff: spin first, then sleep from 1 us doubling up to 100 us */
+#define BACKOFF_SPIN_NS			(10 * NSEC_PER_USEC)
+#define BACKOFF_MIN_NS			NSEC_PER_USEC
+#define BACKOFF_MAX_NS			(100 * NSEC_PER_USEC)
 
 /* Transport packet header */
 #define CRC8_POLY			0x07
 #define CRC8_XOROUT			0x55
 
-/* TBT control packets use 32-bit CRC */
-static u32 crc32_table_le[4][256];
-static u32 *crc32_t0, *crc32_t1, *crc32_t2, *crc32_t3;
+/* TBT control packets use 32-bit CRC, computed with slice-by-8 tables */
+static u32 crc32_table_le[8][256];
+
+/* Transport headers use 8-bit CRC, computed a byte at a time with this table */
+static u8 crc8_table[256];
+static pthread_once_t crc8_once = PTHREAD_ONCE_INIT;
+
+/* CRC32C implementations chosen at the initialization */
+static u32 (*crc32_impl)(u32 crc, const u8 *data, u64 size);
+static u32 (*crc32_be32_impl)(u32 crc, u32 *dst, const u32 *src, u64 len);
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+/* Buffer reused across the sysfs attribute reads, per thread */
+static __thread char sysfs_attr_buf[MAX_LEN];
 
 static bool is_page_aligned(u64 off)
 {
 	return !off || ((PAGE_SIZE % off) == 0);
 }
 
-static bool is_arch_x86(void)
+static u32 crc32_table(u32 crc, const u8 *data, u64 size)
 {
-	char *path = "uname -m | grep x86 | wc -l";
-	char *bash_result;
-	bool ret;
+	u64 q;
+
+	for (; size && ((uintptr_t)data & 7); size--)
+		crc = crc32_table_le[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	for (; size >= 8; size -= 8, data += 8) {
+		memcpy(&q, data, sizeof(q));
+		q = le64toh(q) ^ crc;
+
+		crc = crc32_table_le[7][q & 0xff] ^
+		      crc32_table_le[6][(q >> 8) & 0xff] ^
+		      crc32_table_le[5][(q >> 16) & 0xff] ^
+		      crc32_table_le[4][(q >> 24) & 0xff] ^
+		      crc32_table_le[3][(q >> 32) & 0xff] ^
+		      crc32_table_le[2][(q >> 40) & 0xff] ^
+		      crc32_table_le[1][(q >> 48) & 0xff] ^
+		      crc32_table_le[0][q >> 56];
+	}
 
-	bash_result = do_bash_cmd(path);
-	ret = strtoud(bash_result);
+	for (; size; size--)
+		crc = crc32_table_le[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
 
-	free(bash_result);
+	return crc;
+}
 
-	return ret;
+static u32 crc32_be32_table(u32 crc, u32 *dst, const u32 *src, u64 len)
+{
+	u32 be, q;
+
+	for (; len; len--) {
+		be = htobe32(*src++);
+		*dst++ = be;
+
+		q = le32toh(be) ^ crc;
+		crc = crc32_table_le[3][q & 0xff] ^
+		      crc32_table_le[2][(q >> 8) & 0xff] ^
+		      crc32_table_le[1][(q >> 16) & 0xff] ^
+		      crc32_table_le[0][q >> 24];
+	}
+
+	return crc;
 }
 
-static bool is_cpu_le(void)
+#if defined(__x86_64__)
+/* SSE4.2 'crc32' instruction implements CRC32C */
+__attribute__((target("sse4.2")))
+static u32 crc32_hw(u32 crc, const u8 *data, u64 size)
 {
-	char *path = "lscpu | grep 'Little Endian' | wc -l";
-	char *bash_result;
-	bool ret;
+	u64 crc64, q;
+
+	for (; size && ((uintptr_t)data & 7); size--)
+		crc = _mm_crc32_u8(crc, *data++);
 
-	bash_result = do_bash_cmd(path);
-	ret = strtoud(bash_result);
+	crc64 = crc;
+	for (; size >= 8; size -= 8, data += 8) {
+		memcpy(&q, data, sizeof(q));
+		crc64 = _mm_crc32_u64(crc64, q);
+	}
+	crc = crc64;
 
-	free(bash_result);
+	for (; size; size--)
+		crc = _mm_crc32_u8(crc, *data++);
 
-	return ret;
+	return crc;
 }
 
-static u32 do_crc(u32 crc, u32 x)
+__attribute__((target("sse4.2")))
+static u32 crc32_be32_hw(u32 crc, u32 *dst, const u32 *src, u64 len)
 {
-	if (is_cpu_le())
-		return crc32_t0[(crc ^ (x)) & 255] ^ (crc >> 8);
-	else
-		return crc32_t0[((crc >> 24) ^ (x)) & 255] ^ (crc << 8);
+	u32 be;
+
+	for (; len; len--) {
+		be = htobe32(*src++);
+		*dst++ = be;
+		crc = _mm_crc32_u32(crc, be);
+	}
+
+	return crc;
 }
 
-static u32 do_crc4(u32 q)
+static bool is_crc32_hw_supported(void)
 {
-	if (is_cpu_le())
-		return (crc32_t3[(q) & 255] ^ crc32_t2[(q >> 8) & 255] ^ \
-			crc32_t1[(q >> 16) & 255] ^ crc32_t0[(q >> 24) & 255]);
-	else
-		return (crc32_t0[(q) & 255] ^ crc32_t1[(q >> 8) & 255] ^ \
-			crc32_t2[(q >> 16) & 255] ^ crc32_t3[(q >> 24) & 255]);
+	u32 eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return ecx & bit_SSE4_2;
 }
+#elif defined(__aarch64__)
+/* ARMv8 CRC extension implements CRC32C via 'crc32c*' instructions */
+__attribute__((target("+crc")))
+static u32 crc32_hw(u32 crc, const u8 *data, u64 size)
+{
+	u64 q;
 
-static void crc32_init(void)
+	for (; size && ((uintptr_t)data & 7); size--)
+		crc = __crc32cb(crc, *data++);
+
+	for (; size >= 8; size -= 8, data += 8) {
+		memcpy(&q, data, sizeof(q));
+		crc = __crc32cd(crc, le64toh(q));
+	}
+
+	for (; size; size--)
+		crc = __crc32cb(crc, *data++);
+
+	return crc;
+}
+
+__attribute__((target("+crc")))
+static u32 crc32_be32_hw(u32 crc, u32 *dst, const u32 *src, u64 len)
+{
+	u32 be;
+
+	for (; len; len--) {
+		be = htobe32(*src++);
+		*dst++ = be;
+		crc = __crc32cw(crc, le32toh(be));
+	}
+
+	return crc;
+}
+
+static bool is_crc32_hw_supported(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#endif
+
+/*
+ * Verifies the selected CRC32C implementation against the check value, and
+ * against the table path for all the alignments and sizes up to 64 bytes.
+ * Returns 'true' if everything matches, 'false' otherwise.
+ */
+static bool crc32_verify(void)
+{
+	const u8 check[] = "123456789";
+	u32 src[16], dst[16];
+	u8 buf[64 + 8];
+	u64 off, size;
+	u32 crc;
+
+	crc = ~crc32_impl(~0, check, sizeof(check) - 1);
+	if (crc != CRC32_CHECK || ~crc32_table(~0, check, sizeof(check) - 1) != CRC32_CHECK)
+		return false;
+
+	for (off = 0; off < sizeof(buf); off++)
+		buf[off] = off * 0x9d + 0x5b;
+
+	for (off = 0; off < 8; off++) {
+		for (size = 0; size <= 64; size++) {
+			if (crc32_impl(~0, buf + off, size) != crc32_table(~0, buf + off, size))
+				return false;
+		}
+	}
+
+	for (size = 0; size < 16; size++)
+		src[size] = size * 0x9e3779b9;
+
+	crc = crc32_be32_impl(~0, dst, src, 16);
+	if ((crc != crc32_be32_table(~0, dst, src, 16)) ||
+	    (crc != crc32_table(~0, (u8*)dst, sizeof(dst))) || (dst[1] != htobe32(src[1])))
+		return false;
+
+	return true;
+}
+
+static void crc32_init_table(void)
 {
 	u32 crc = 1;
 	u32 i, j;
@@ -102,16 +255,55 @@ static void crc32_init(void)
 	for (i = 0; i < 256; i++) {
 		crc = crc32_table_le[0][i];
 
-		for (j = 1; j < 4; j++) {
+		for (j = 1; j < 8; j++) {
 			crc = crc32_table_le[0][crc & 0xff] ^ (crc >> 8);
 			crc32_table_le[j][i] = crc;
 		}
 	}
+}
+
+static void crc8_init(void)
+{
+	u32 i, j;
+	u8 crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
 
-	crc32_t0 = crc32_table_le[0];
-	crc32_t1 = crc32_table_le[1];
-	crc32_t2 = crc32_table_le[2];
-	crc32_t3 = crc32_table_le[3];
+		for (j = 0; j < 8; j++) {
+			if (crc & 0x80)
+				crc = (crc << 1) ^ CRC8_POLY;
+			else
+				crc <<= 1;
+		}
+
+		crc8_table[i] = crc;
+	}
+}
+
+/*
+ * Builds the tables once and selects the hardware CRC32C path if the CPU supports
+ * it and it agrees with the table path.
+ */
+static void crc32_init(void)
+{
+	crc32_init_table();
+	crc32_impl = crc32_table;
+	crc32_be32_impl = crc32_be32_table;
+
+#ifdef CRC32_HW
+	if (!is_crc32_hw_supported())
+		return;
+
+	crc32_impl = crc32_hw;
+	crc32_be32_impl = crc32_be32_hw;
+
+	if (!crc32_verify()) {
+		fprintf(stderr, "WARN: h/w CRC32C mismatch, using the table path\n");
+		crc32_impl = crc32_table;
+		crc32_be32_impl = crc32_be32_table;
+	}
+#endif
 }
 
 struct list_item* list_add(struct list_item *tail, void *val)
@@ -268,75 +460,94 @@ u64 get_size_least_set(u64 bitmask)
 	return (u64)1 << (ffsll(bitmask) - 1);
 }
 
-u32 get_crc32(u32 crc, const u8 *data, u64 size)
+/* Returns the monotonic time in ns */
+u64 get_time_ns(void)
 {
-	u64 rem_size;
-	u32 *b, q;
-	u64 i;
+	struct timespec ts;
 
-	crc32_init();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	if ((long)data & 3 && size) {
-		do {
-			crc = do_crc(crc, *data++);
-		} while ((--size) && ((long)data) & 3);
-	}
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
 
-	rem_size = size & 3;
-	size = size >> 2;
+void backoff_init(struct backoff *b, u64 timeout_ns)
+{
+	b->start = get_time_ns();
+	b->deadline = b->start + timeout_ns;
+	b->delay = BACKOFF_MIN_NS;
+}
 
-	b = (u32*)data;
+/*
+ * Waits for the next poll of the condition. Completions are usually quick, hence
+ * spin for the first few us and only then start sleeping, never past the deadline.
+ * Returns false once the deadline has passed.
+ */
+bool backoff_wait(struct backoff *b)
+{
+	u64 now = get_time_ns();
+	struct timespec ts;
+	u64 delay;
 
-	if (is_arch_x86()) {
-		--b;
+	if (now >= b->deadline)
+		return false;
 
-		for (i = 0; i < size; i++) {
-			q = crc ^ *++b;
-			crc = do_crc4(q);
-		}
+	if (now - b->start < BACKOFF_SPIN_NS) {
+		cpu_relax();
+		return true;
+	}
 
-		size = rem_size;
+	delay = b->deadline - now < b->delay ? b->deadline - now : b->delay;
+	ts.tv_sec = delay / NSEC_PER_SEC;
+	ts.tv_nsec = delay % NSEC_PER_SEC;
+	nanosleep(&ts, NULL);
 
-		if (size) {
-			u8 *p = (u8*)(b + 1) - 1;
+	if (b->delay < BACKOFF_MAX_NS)
+		b->delay *= 2;
 
-			for (i = 0; i < size; i++)
-				crc = do_crc(crc, *++p);
-		}
-	} else {
-		for (--b; size; --size) {
-			q = crc ^ *++b;
-			crc = do_crc4(q);
-		}
+	return true;
+}
 
-		size = rem_size;
+/*
+ * Returns the CRC32C of the data, without the pre and post inversion.
+ * Tables are initialized on the first call.
+ */
+u32 get_crc32(u32 crc, const u8 *data, u64 size)
+{
+	pthread_once(&crc32_once, crc32_init);
 
-		if (size) {
-			u8 *p = (u8*)(b + 1) - 1;
+	return crc32_impl(crc, data, size);
+}
 
-			do {
-				crc = do_crc(crc, *++p);
-			} while (--size);
-		}
-	}
+/*
+ * Stores 'len' dwords of 'src' in big-endian at 'dst' (e.g., straight into a DMA
+ * buffer) and folds the stored bytes into the CRC32C in the same pass, without the
+ * pre and post inversion.
+ */
+u32 store_be32_crc32(u32 crc, u32 *dst, const u32 *src, u64 len)
+{
+	pthread_once(&crc32_once, crc32_init);
 
-	return crc;
+	return crc32_be32_impl(crc, dst, src, len);
 }
 
-u8 get_crc8(u8 crc, const u8 *data, u64 size)
+/*
+ * Runs the CRC32C self-test on the selected implementation.
+ * Returns 'true' if it passes, 'false' otherwise.
+ */
+bool crc32_self_test(void)
 {
-	u8 i;
+	pthread_once(&crc32_once, crc32_init);
 
-	while (size--) {
-		crc ^= *data++;
+	return crc32_verify();
+}
 
-		for (i = 0; i < 8; i++) {
-			if (crc & 0x80)
-				crc = (crc << 1) ^ CRC8_POLY;
-			else
-				crc <<=1;
-		}
-	}
+/* Table is initialized on the first call */
+u8 get_crc8(u8 crc, const u8 *data, u64 size)
+{
+	pthread_once(&crc8_once, crc8_init);
+
+	while (size--)
+		crc = crc8_table[crc ^ *data++];
 
 	return crc ^ CRC8_XOROUT;
 }
@@ -493,3 +704,136 @@ bool is_link_nabs(const char *name)
 
 	return false;
 }
+
+/*
+ * Opens the sysfs directory at the given path, to be used as the base directory
+ * for the attribute reads.
+ * Returns the directory fd, or '-1' on failure.
+ */
+int open_sysfs_dir(const char *path)
+{
+	return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * Reads the sysfs attribute 'attr' (relative to the directory 'dir_fd') in-process
+ * and returns its value with the whitespaces trimmed.
+ * The returned string lives in a buffer which is reused across the reads (of the
+ * calling thread), hence the caller needs to copy it if the value is required after a
+ * subsequent read.
+ * Returns NULL if the attribute can't be read.
+ *
+ * NOTE: Akin to 'is_link_nabs', the software exits if the attribute turns out to be
+ * a symlink/hardlink.
+ */
+char* read_sysfs_attr(int dir_fd, const char *attr)
+{
+	struct stat st;
+	ssize_t len;
+	int fd;
+
+	fd = openat(dir_fd, attr, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ELOOP)
+			return NULL;
+
+		fprintf(stderr, "discovered file system corruptions, exiting...\n");
+		exit(1);
+	}
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+
+	if (!S_ISREG(st.st_mode) || (st.st_nlink > 1)) {
+		fprintf(stderr, "discovered file system corruptions, exiting...\n");
+		exit(1);
+	}
+
+	len = pread(fd, sysfs_attr_buf, sizeof(sysfs_attr_buf) - 1, 0);
+	close(fd);
+
+	if (len < 0)
+		return NULL;
+
+	sysfs_attr_buf[len] = '\0';
+
+	return trim_white_space(sysfs_attr_buf);
+}
+
+/*
+ * Writes the string 'val' to the sysfs attribute 'attr' (relative to the directory
+ * 'dir_fd', or the current directory if 'AT_FDCWD') in-process, as a single write.
+ * Returns 0 on success, else the error of opening or writing the attribute.
+ *
+ * NOTE: Akin to 'read_sysfs_attr', the software exits if the attribute turns out to be
+ * a symlink/hardlink.
+ */
+int write_sysfs_attr(int dir_fd, const char *attr, const char *val)
+{
+	u64 len = strlen(val);
+	struct stat st;
+	int fd, ret = 0;
+
+	fd = openat(dir_fd, attr, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ELOOP)
+			return errno;
+
+		fprintf(stderr, "discovered file system corruptions, exiting...\n");
+		exit(1);
+	}
+
+	if (fstat(fd, &st)) {
+		ret = errno;
+		close(fd);
+
+		return ret;
+	}
+
+	if (!S_ISREG(st.st_mode) || (st.st_nlink > 1)) {
+		fprintf(stderr, "discovered file system corruptions, exiting...\n");
+		exit(1);
+	}
+
+	errno = 0;
+	if (write(fd, val, len) != (ssize_t)len)
+		ret = errno ? errno : EIO;
+
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Reads the sysfs attribute as a decimal value into 'val'.
+ * Returns 'true' on success, 'false' otherwise.
+ */
+bool read_sysfs_attr_u32(int dir_fd, const char *attr, u32 *val)
+{
+	char *str = read_sysfs_attr(dir_fd, attr);
+
+	if (!str)
+		return false;
+
+	*val = strtoud(str);
+
+	return true;
+}
+
+/*
+ * Reads the sysfs attribute as a hexadecimal value into 'val'.
+ * Returns 'true' on success, 'false' otherwise.
+ */
+bool read_sysfs_attr_hex(int dir_fd, const char *attr, u32 *val)
+{
+	char *str = read_sysfs_attr(dir_fd, attr);
+
+	if (!str)
+		return false;
+
+	*val = strtouh(str);
+
+	return true;
+}
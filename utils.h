@@ -28,12 +28,28 @@
 
 #define PAGE_SIZE		sysconf(_SC_PAGE_SIZE)
 
+/* Rounds 'x' up to the multiple of 'a' (power of 2) */
+#define GET_ALIGNED_PAGE(x, a)		_GET_ALIGNED_PAGE(x, (typeof(x))(a) - 1)
+#define _GET_ALIGNED_PAGE(x, a)		(((x) + (a)) & ~(a))
+
 #define READ_FLAG		BIT(0)
 #define WRITE_FLAG		BIT(1)
 #define RDWR_FLAG		(READ_FLAG | WRITE_FLAG)
 
 #define msleep(x)		usleep(x * 1000)
 
+#define NSEC_PER_USEC		((u64)1000)
+#define NSEC_PER_SEC		((u64)1000000000)
+
+/* Hint to the CPU that we're in a busy-wait loop */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()		__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()		__asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax()		__asm__ __volatile__("" ::: "memory")
+#endif
+
 #define REDIRECTED_NULL		"0>/dev/null 1>/dev/null 2>/dev/null"
 
 #define COMPLEMENT_BIT64	(u64)~0
@@ -48,6 +64,16 @@ struct list_item {
 	struct list_item *next;
 };
 
+/*
+ * Adaptive backoff for the polling loops: spin for a short while, then sleep for
+ * exponentially longer periods, until the deadline.
+ */
+struct backoff {
+	u64 start;	/* ns, monotonic */
+	u64 deadline;
+	u64 delay;	/* Next sleep period, ns */
+};
+
 /*
  * Mapped virtual and physical addresses.
  * Default size is coded to 'PAGE_SIZE'.
@@ -70,7 +96,12 @@ void* get_user_mapped_write_va(int fd, u64 off, u64 size);
 void* get_user_mapped_rw_va(int fd, u64 off, u64 size);
 void unmap_user_mapped_va(void *addr, u64 size);
 u64 get_size_least_set(u64 bitmask);
+u64 get_time_ns(void);
+void backoff_init(struct backoff *b, u64 timeout_ns);
+bool backoff_wait(struct backoff *b);
 u32 get_crc32(u32 crc, const u8 *data, u64 size);
+u32 store_be32_crc32(u32 crc, u32 *dst, const u32 *src, u64 len);
+bool crc32_self_test(void);
 u8 get_crc8(u8 crc, const u8 *data, u64 size);
 void convert_to_be32(u32 *data, u64 len);
 void be32_to_u32(u32 *data, u64 len);
@@ -83,3 +114,8 @@ char** list_to_numbered_array(struct list_item *item);
 bool isnum(const char *arr);
 void free_list(struct list_item *head);
 bool is_link_nabs(const char *name);
+int open_sysfs_dir(const char *path);
+char* read_sysfs_attr(int dir_fd, const char *attr);
+int write_sysfs_attr(int dir_fd, const char *attr, const char *val);
+bool read_sysfs_attr_u32(int dir_fd, const char *attr, u32 *val);
+bool read_sysfs_attr_hex(int dir_fd, const char *attr, u32 *val);